@@ -0,0 +1,50 @@
+#include <stddef.h>
+
+#include "alloc.h"
+
+/**
+ * ASan brings its own allocator, which the __libc_* names would bypass,
+ * so sanitized builds leave the allocator alone and count nothing.
+ */
+#if !defined(__SANITIZE_ADDRESS__)
+/* glibc exports its allocator under these names for wrappers like ours */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long __nr_allocations = 0;
+
+void *malloc(size_t size)
+{
+	__nr_allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__nr_allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__nr_allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+unsigned long nr_allocations(void)
+{
+	return __nr_allocations;
+}
+#else
+unsigned long nr_allocations(void)
+{
+	return 0;
+}
+#endif
@@ -0,0 +1,17 @@
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+/***********************************************************************
+ * nr_allocations()
+ *
+ * DESCRIPTION
+ *  malloc(), calloc(), and realloc() are interposed to count the heap
+ *  allocations of the shell, including those made inside the C library.
+ *  Builds with -fsanitize=address do not count and always return 0.
+ *
+ * RETURN VALUE
+ *  Return the number of allocations made so far
+ */
+unsigned long nr_allocations(void);
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ * Microbenchmark of parse_command() against the byte-at-a-time isspace()
+ * loop it replaced, on machine-generated lines of 4 KB up to 1 MB.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "types.h"
+#include "parser.h"
+
+#define BYTES_PER_RUN	(256 << 20)
+
+static int parse_command_isspace(char *command, struct tokens *tokens)
+{
+	char *curr = command;
+	int token_started = false;
+	tokens->nr_tokens = 0;
+
+	while (*curr != '\0') {
+		if (isspace(*curr)) {
+			*curr = '\0';
+			token_started = false;
+		} else {
+			if (!token_started) {
+				if (tokens->nr_tokens + 1 >= tokens->size) {
+					int size = tokens->size ? tokens->size * 2 : 32;
+					char **v = realloc(tokens->tokens, sizeof(char *) * size);
+
+					if (!v) return -ENOMEM;
+					tokens->tokens = v;
+					tokens->size = size;
+				}
+				tokens->tokens[tokens->nr_tokens] = curr;
+				tokens->nr_tokens += 1;
+				token_started = true;
+			}
+		}
+		curr++;
+	}
+	if (tokens->nr_tokens == 0) return 0;
+
+	tokens->tokens[tokens->nr_tokens] = NULL;
+
+	return 1;
+}
+
+/* Tokens of 1-16 characters separated by 1-3 spaces or tabs */
+static void generate_line(char *line, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		int n = 1 + rand() % 16;
+
+		while (n-- && i < len) line[i++] = 'a' + rand() % 26;
+
+		n = 1 + rand() % 3;
+		while (n-- && i < len) line[i++] = rand() % 4 ? ' ' : '\t';
+	}
+	line[len - 1] = '\n';
+	line[len] = '\0';
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int (*parse)(char *, struct tokens *), const char *line,
+		char *work, size_t len, int *nr_tokens)
+{
+	struct tokens tokens = { 0 };
+	int nr_runs = BYTES_PER_RUN / len;
+	double start = now();
+
+	for (int i = 0; i < nr_runs; i++) {
+		memcpy(work, line, len + 1);
+		if (parse) parse(work, &tokens);
+	}
+	*nr_tokens = tokens.nr_tokens;
+	free(tokens.tokens);
+
+	return (double)nr_runs * len / (now() - start) / (1 << 20);
+}
+
+int main(int argc, const char *argv[])
+{
+	static const size_t sizes[] = { 4 << 10, 64 << 10, 256 << 10, 1 << 20 };
+
+	printf("%8s %12s %12s %12s %8s\n", "line", "memcpy MB/s", "isspace MB/s",
+			"parse MB/s", "speedup");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t len = sizes[i];
+		char *line = malloc(len + 1);
+		char *work = malloc(len + 1);
+		double copy, old, new;
+		int nr_old, nr_new;
+
+		generate_line(line, len);
+
+		copy = run(NULL, line, work, len, &nr_old);
+		old = run(parse_command_isspace, line, work, len, &nr_old);
+		new = run(parse_command, line, work, len, &nr_new);
+
+		if (nr_old != nr_new) {
+			fprintf(stderr, "Token count mismatch: %d vs %d\n", nr_old, nr_new);
+			return EXIT_FAILURE;
+		}
+
+		/* Take the memcpy() restoring the line out of both */
+		old = 1 / (1 / old - 1 / copy);
+		new = 1 / (1 / new - 1 / copy);
+		printf("%7zuK %12.0f %12.0f %12.0f %7.1fx\n", len >> 10, copy, old, new, new / old);
+
+		free(line);
+		free(work);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/**
+ * Throughput of a "cat | cut" shaped pipeline for the pipe capacities
+ * "pipesize" can set. The producer writes 128 KB at a time like cat(1),
+ * and the consumer reads 4 KB at a time like stdio does, so the consumer
+ * is the one that falls behind. Context switches are those of both ends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define BYTES_PER_RUN	(1UL << 30)
+#define WRITE_SIZE	(128 << 10)
+#define READ_SIZE	(4 << 10)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void produce(int fd)
+{
+	static char buffer[WRITE_SIZE];
+	size_t left = BYTES_PER_RUN;
+
+	memset(buffer, 'x', sizeof(buffer));
+
+	while (left) {
+		ssize_t len = write(fd, buffer, left < sizeof(buffer) ? left : sizeof(buffer));
+
+		if (len <= 0) _exit(EXIT_FAILURE);
+		left -= len;
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void consume(int fd)
+{
+	static char buffer[READ_SIZE];
+	unsigned long sum = 0;
+	ssize_t len;
+
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0) sum += buffer[len - 1];
+
+	_exit(sum ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static pid_t start(void (*fn)(int), int fd, int other)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		close(other);
+		fn(fd);
+	}
+	return pid;
+}
+
+static int run(long pipe_size, double *mbps, long *nr_switches)
+{
+	struct rusage ru;
+	int fds[2], status, ret = 0;
+	double begin;
+
+	if (pipe(fds) < 0) return -1;
+	if (pipe_size && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	begin = now();
+	start(produce, fds[1], fds[0]);
+	start(consume, fds[0], fds[1]);
+	close(fds[0]);
+	close(fds[1]);
+
+	*nr_switches = 0;
+	for (int i = 0; i < 2; i++) {
+		wait4(-1, &status, 0, &ru);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ret = -1;
+		*nr_switches += ru.ru_nvcsw + ru.ru_nivcsw;
+	}
+	*mbps = BYTES_PER_RUN / (now() - begin) / (1 << 20);
+
+	return ret;
+}
+
+int main(int argc, const char *argv[])
+{
+	static const long sizes[] = { 0, 256 << 10, 1 << 20 };
+	double base = 0;
+
+	printf("%8s %10s %12s %8s\n", "pipe", "MB/s", "switches", "speedup");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double mbps;
+		long nr_switches;
+
+		if (run(sizes[i], &mbps, &nr_switches)) {
+			fprintf(stderr, "Unable to run with a %ldK pipe\n", sizes[i] >> 10);
+			continue;
+		}
+		if (!base) base = mbps;
+
+		if (sizes[i]) {
+			printf("%7ldK", sizes[i] >> 10);
+		} else {
+			printf("%8s", "default");
+		}
+		printf(" %10.0f %12ld %7.1fx\n", mbps, nr_switches, mbps / base);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -15,165 +15,3324 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <string.h>
+#include <ctype.h>
 
 #include "types.h"
 #include "list_head.h"
 #include "parser.h"
+#include "alloc.h"
 
 static int __process_cmd(char * command);
+static int run_command(struct tokens *vector);
 static int history_command(char* tokens[], int case_num);
 static int built_in_command(int nr_tokens, char *tokens[]);
+static bool __verbose;
+
+/***********************************************************************
+ * Performance counters
+ *
+ * DESCRIPTION
+ *   Counters and latency histograms that are always on, printed by the
+ *   "stats" built-in. Histograms are log-bucketed like HdrHistogram: each
+ *   power of two of nanoseconds is split into 1 << HISTOGRAM_SUB_BITS
+ *   buckets, so a bucket is within 25% of any value in it, and recording
+ *   is a couple of bit operations and an increment.
+ */
+#define HISTOGRAM_SUB_BITS	2
+#define NR_HISTOGRAM_BUCKETS	(64 << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[NR_HISTOGRAM_BUCKETS];
+};
+
+static struct {
+	unsigned long nr_commands;
+	unsigned long nr_builtins;
+	unsigned long nr_forks;		/* fork() or posix_spawn() */
+	unsigned long nr_execs;
+	unsigned long nr_exec_failures;
+	struct histogram parse;
+	struct histogram command;	/* run_command() */
+	struct histogram launch;	/* From fork to exec */
+	struct histogram wait;
+	struct histogram history;	/* append_history() */
+} __stats;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int histogram_bucket(uint64_t value)
+{
+	int shift;
+
+	if (value < (1 << HISTOGRAM_SUB_BITS)) return value;
+
+	shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+		((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/* The smallest value that goes into @bucket */
+static uint64_t histogram_floor(unsigned int bucket)
+{
+	unsigned int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+
+	if (bucket < (1 << HISTOGRAM_SUB_BITS)) return bucket;
+
+	return (uint64_t)((1 << HISTOGRAM_SUB_BITS) |
+			(bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << shift;
+}
+
+static inline uint64_t record_latency(struct histogram *h, uint64_t start)
+{
+	uint64_t end = now_ns(), value = end - start;
+
+	if (!h->count || value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+	h->count++;
+	h->sum += value;
+	h->buckets[histogram_bucket(value)]++;
+
+	return end;
+}
+
+
+/***********************************************************************
+ * Trace export
+ *
+ * DESCRIPTION
+ *   With "-T file", spans of parsing, running commands, launching and
+ *   waiting for stages and appending history are kept in memory, along
+ *   with one span per child from its launch until it is reaped. They are
+ *   written out in the Chrome trace event format by finalize(), to be
+ *   opened in chrome://tracing or Perfetto. The shell is one track and
+ *   every child gets its own, named after the command.
+ */
+enum trace_type {
+	TRACE_PARSE,
+	TRACE_COMMAND,
+	TRACE_LAUNCH,
+	TRACE_WAIT,
+	TRACE_HISTORY,
+	TRACE_CHILD,
+};
+
+static const char * const __trace_names[] = {
+	[TRACE_PARSE] = "parse",
+	[TRACE_COMMAND] = "command",
+	[TRACE_LAUNCH] = "launch",
+	[TRACE_WAIT] = "wait",
+	[TRACE_HISTORY] = "history",
+	[TRACE_CHILD] = "run",
+};
+
+struct trace_event {
+	uint64_t start;
+	uint64_t end;
+	pid_t tid;		/* 0 for the shell */
+	enum trace_type type;
+	char name[32];		/* Of the command involved, if any */
+};
+
+static const char *__trace_file = NULL;
+static struct trace_event *__trace = NULL;
+static size_t __nr_trace = 0;
+static size_t __trace_size = 0;
+
+static void trace_span(enum trace_type type, uint64_t start, uint64_t end,
+		pid_t tid, const char *name)
+{
+	struct trace_event *ev;
+
+	if (!__trace_file) return;
+
+	if (__nr_trace == __trace_size) {
+		size_t size = __trace_size ? __trace_size * 2 : 1024;
+
+		if (!(ev = realloc(__trace, sizeof(*ev) * size))) return;
+		__trace = ev;
+		__trace_size = size;
+	}
+	ev = __trace + __nr_trace++;
+	ev->start = start;
+	ev->end = end;
+	ev->tid = tid;
+	ev->type = type;
+	snprintf(ev->name, sizeof(ev->name), "%s", name ? name : "");
+}
+
+static void write_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fp, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+static void flush_trace(void)
+{
+	pid_t pid = getpid();
+	FILE *fp;
+
+	if (!__trace_file) return;
+
+	if (!(fp = fopen(__trace_file, "w"))) {
+		fprintf(stderr, "Unable to write trace %s\n", __trace_file);
+		goto out;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"name\":\"posh\"}}", pid, pid);
+
+	for (size_t i = 0; i < __nr_trace; i++) {
+		struct trace_event *ev = __trace + i;
+		pid_t tid = ev->tid ? ev->tid : pid;
+
+		if (ev->type == TRACE_CHILD) {
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+					"\"tid\":%d,\"args\":{\"name\":", pid, tid);
+			write_json_string(fp, ev->name);
+			fprintf(fp, "}}");
+		}
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f", __trace_names[ev->type], pid, tid,
+				ev->start / 1e3, (ev->end - ev->start) / 1e3);
+		if (ev->name[0]) {
+			fprintf(fp, ",\"args\":{\"command\":");
+			write_json_string(fp, ev->name);
+			fprintf(fp, "}");
+		}
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+out:
+	free(__trace);
+}
+
+
+/***********************************************************************
+ * Flight recorder
+ *
+ * DESCRIPTION
+ *   The last NR_FLIGHT_EVENTS children that exited, with a hash of their
+ *   argv, when they were launched and reaped, how they exited and what
+ *   wait4() said they used. Recording is a store into a static ring, so
+ *   it is always on. SIGUSR1 dumps the ring as text to the file given
+ *   with "-F", or posh-flight.<pid> in $XDG_RUNTIME_DIR or else in the
+ *   directory the shell started in, right from the signal handler,
+ *   so it works even while the shell is blocked on a slow command. The
+ *   handler only uses async-signal-safe calls and formats the numbers
+ *   itself. An event is published by bumping __nr_flight after it has
+ *   been written, and the handler skips the slot the next one goes to,
+ *   so it never sees one half-way. The dump thus holds one event less
+ *   than the ring once it has wrapped.
+ */
+#define NR_FLIGHT_EVENTS	4096
+
+struct flight_event {
+	uint64_t hash;
+	uint64_t start;
+	uint64_t end;
+	pid_t pid;
+	int status;
+	uint64_t utime;		/* In microseconds */
+	uint64_t stime;
+	long maxrss;
+	long minflt;
+	long majflt;
+	long nvcsw;
+	long nivcsw;
+};
+
+static struct flight_event __flight[NR_FLIGHT_EVENTS];
+static volatile uint64_t __nr_flight = 0;
+static const char *__flight_file = NULL;
+static char __flight_path[PATH_MAX];
+static int __flight_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+static uint64_t hash_argv(char * const argv[])
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	for (; *argv; argv++) {
+		for (const char *p = *argv; ; p++) {
+			hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+			if (!*p) break;
+		}
+	}
+	return hash;
+}
+
+static void record_flight(uint64_t hash, pid_t pid, uint64_t start, uint64_t end,
+		int status, const struct rusage *ru)
+{
+	struct flight_event *ev = __flight + __nr_flight % NR_FLIGHT_EVENTS;
+
+	ev->hash = hash;
+	ev->start = start;
+	ev->end = end;
+	ev->pid = pid;
+	ev->status = status;
+	ev->utime = ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+	ev->stime = ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+	ev->maxrss = ru->ru_maxrss;
+	ev->minflt = ru->ru_minflt;
+	ev->majflt = ru->ru_majflt;
+	ev->nvcsw = ru->ru_nvcsw;
+	ev->nivcsw = ru->ru_nivcsw;
+
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	__nr_flight = __nr_flight + 1;
+}
+
+/* snprintf() is not async-signal-safe, so numbers are formatted by hand */
+static char *put_number(char *p, uint64_t value, unsigned int base, char sep)
+{
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = "0123456789abcdef"[value % base];
+	} while (value /= base);
+
+	while (n) *p++ = digits[--n];
+	*p++ = sep;
+
+	return p;
+}
+
+static void dump_flight(int signal)
+{
+	static const char header[] =
+		"# seq pid hash start_ns end_ns status utime_us stime_us "
+		"maxrss_kb minflt majflt nvcsw nivcsw\n";
+	int saved_errno = errno;
+	uint64_t nr = __nr_flight;
+	/* The oldest slot is where record_flight() may be writing the next one */
+	uint64_t seq = nr >= NR_FLIGHT_EVENTS ? nr - NR_FLIGHT_EVENTS + 1 : 0;
+	char line[256], *p;
+	int fd;
+
+	__atomic_signal_fence(__ATOMIC_ACQUIRE);
+
+	fd = open(__flight_path, __flight_flags, 0600);
+	if (fd < 0) goto out;
+
+	write(fd, header, sizeof(header) - 1);
+
+	for (; seq < nr; seq++) {
+		struct flight_event *ev = __flight + seq % NR_FLIGHT_EVENTS;
+		int status = WIFEXITED(ev->status) ? WEXITSTATUS(ev->status)
+				: 128 + WTERMSIG(ev->status);
+
+		p = put_number(line, seq, 10, ' ');
+		p = put_number(p, ev->pid, 10, ' ');
+		p = put_number(p, ev->hash, 16, ' ');
+		p = put_number(p, ev->start, 10, ' ');
+		p = put_number(p, ev->end, 10, ' ');
+		p = put_number(p, status, 10, ' ');
+		p = put_number(p, ev->utime, 10, ' ');
+		p = put_number(p, ev->stime, 10, ' ');
+		p = put_number(p, ev->maxrss, 10, ' ');
+		p = put_number(p, ev->minflt, 10, ' ');
+		p = put_number(p, ev->majflt, 10, ' ');
+		p = put_number(p, ev->nvcsw, 10, ' ');
+		p = put_number(p, ev->nivcsw, 10, '\n');
+		write(fd, line, p - line);
+	}
+	close(fd);
+out:
+	errno = saved_errno;
+}
+
+static int init_flight_recorder(void)
+{
+	struct sigaction sa = {
+		.sa_handler = dump_flight,
+		.sa_flags = SA_RESTART,
+	};
+
+	if (__flight_file) {
+		snprintf(__flight_path, sizeof(__flight_path), "%s", __flight_file);
+	} else {
+		char cwd[PATH_MAX];
+		const char *dir = getenv("XDG_RUNTIME_DIR");
+
+		/* Not a shared directory like /tmp, and never through a planted link */
+		if (!dir || dir[0] != '/') dir = getcwd(cwd, sizeof(cwd)) ? cwd : ".";
+		if (snprintf(__flight_path, sizeof(__flight_path), "%s/posh-flight.%d",
+					dir, getpid()) >= (int)sizeof(__flight_path))
+			return -ENAMETOOLONG;
+		__flight_flags |= O_NOFOLLOW;
+	}
+
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGUSR1, &sa, NULL);
+}
+
+/***********************************************************************
+ * Command location cache
+ *
+ * DESCRIPTION
+ *   Remember where each command name was found in $PATH, like the hash
+ *   built-in of bash. Names are resolved in the shell before any child is
+ *   started so that unknown commands fail without fork(). The cache is
+ *   flushed when $PATH changes or on "hash -r".
+ */
+#define NR_PATH_BUCKETS	64
+
+struct path_entry {
+	struct hlist_node hlist;
+	unsigned int hits;
+	char *name;
+	char path[];
+};
+
+static struct hlist_head __path_cache[NR_PATH_BUCKETS];
+static char *__path_cache_env = NULL;	/* $PATH the cache is built against */
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name) hash = hash * 33 + (unsigned char)*name++;
+
+	return hash % NR_PATH_BUCKETS;
+}
+
+static void flush_path_cache(void)
+{
+	struct path_entry *pe;
+	struct hlist_node *n;
+
+	for (int i = 0; i < NR_PATH_BUCKETS; i++) {
+		hlist_for_each_entry_safe(pe, n, __path_cache + i, hlist) {
+			hlist_del(&pe->hlist);
+			free(pe);
+		}
+	}
+}
+
+static struct path_entry *lookup_path_cache(const char *name)
+{
+	struct path_entry *pe;
+
+	hlist_for_each_entry(pe, __path_cache + hash_name(name), hlist) {
+		if (strcmp(pe->name, name) == 0) return pe;
+	}
+	return NULL;
+}
+
+static bool is_executable(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/***********************************************************************
+ * search_path()
+ *
+ * DESCRIPTION
+ *   Walk @env (a copy of $PATH) for @name. Candidates are put together
+ *   in a static buffer; only hits in absolute directories are cached
+ *   since the others depend on the cwd.
+ *
+ * RETURN VALUE
+ *   Return the path to the executable, which stays valid until the next
+ *   lookup if it is a relative one
+ *   Return NULL if @name is not found
+ */
+static const char *search_path(const char *name, const char *env)
+{
+	static char path[PATH_MAX];
+	size_t len_name = strlen(name);
+	const char *dir = env;
+
+	while (true) {
+		const char *end = strchrnul(dir, ':');
+		size_t len_dir = end - dir;
+
+		/* An empty $PATH element stands for the current directory */
+		if (len_dir == 0) {
+			dir = ".";
+			len_dir = 1;
+		}
+
+		if (len_dir + 1 + len_name < sizeof(path)) {
+			memcpy(path, dir, len_dir);
+			path[len_dir] = '/';
+			memcpy(path + len_dir + 1, name, len_name + 1);
+
+			if (is_executable(path)) {
+				struct path_entry *pe;
+				size_t len = len_dir + 1 + len_name + 1;
+
+				if (path[0] != '/') return path;
+				if (!(pe = malloc(sizeof(*pe) + len + len_name + 1))) return path;
+
+				memcpy(pe->path, path, len);
+				pe->name = pe->path + len;
+				memcpy(pe->name, name, len_name + 1);
+				pe->hits = 1;
+				hlist_add_head(&pe->hlist, __path_cache + hash_name(name));
+
+				return pe->path;
+			}
+		}
+
+		if (*end == '\0') break;
+		dir = end + 1;
+	}
+	return NULL;
+}
+
+/***********************************************************************
+ * resolve_command()
+ *
+ * DESCRIPTION
+ *   Find the executable for @name. Names containing '/' are used as is.
+ *
+ * RETURN VALUE
+ *   Return the path to the executable
+ *   Return NULL if @name cannot be executed
+ */
+static const char *resolve_command(const char *name)
+{
+	const char *env = getenv("PATH");
+	struct path_entry *pe;
+
+	if (strchr(name, '/')) return is_executable(name) ? name : NULL;
+
+	if (!env) env = "/bin:/usr/bin";
+	if (!__path_cache_env || strcmp(__path_cache_env, env) != 0) {
+		flush_path_cache();
+		free(__path_cache_env);
+		__path_cache_env = strdup(env);
+	}
+
+	if ((pe = lookup_path_cache(name))) {
+		pe->hits++;
+		return pe->path;
+	}
+
+	return search_path(name, env);
+}
+
+/***********************************************************************
+ * forget_command()
+ *
+ * DESCRIPTION
+ *   Drop the stale cache entry for @name after its exec failed.
+ */
+static void forget_command(const char *name)
+{
+	struct path_entry *pe = lookup_path_cache(name);
+
+	if (!pe) return;
+
+	hlist_del(&pe->hlist);
+	free(pe);
+}
+
+static int hash_command(int nr_tokens, char *tokens[])
+{
+	struct path_entry *pe;
+
+	if (nr_tokens > 1 && strcmp(tokens[1], "-r") == 0) {
+		flush_path_cache();
+		return 1;
+	}
+
+	for (int i = 0; i < NR_PATH_BUCKETS; i++) {
+		hlist_for_each_entry(pe, __path_cache + i, hlist) {
+			fprintf(stderr, "%4u\t%s\n", pe->hits, pe->path);
+		}
+	}
+	return 1;
+}
+
+
+/***********************************************************************
+ * Batch input
+ *
+ * DESCRIPTION
+ *   When stdin is a seekable file rather than a terminal (e.g., posh -q <
+ *   script), commands are read with pread() in large blocks into a buffer
+ *   of the shell instead of one byte per read(2) through unbuffered stdio.
+ *   pread() leaves the file offset alone, so nothing can be read twice
+ *   after fork() the way buffered stdio may. The offset is moved to what
+ *   the shell has consumed before children start, so those reading stdin
+ *   get the rest of the script, and a child that consumed some of it makes
+ *   the shell drop its read-ahead afterwards.
+ */
+#define INPUT_BUFFER_SIZE	(64 << 10)
+
+static struct {
+	bool batch;
+	off_t offset;		/* File offset of buffer[head] */
+	size_t head;
+	size_t tail;
+	char buffer[INPUT_BUFFER_SIZE];
+} __input;
+
+static void init_input(void)
+{
+	if (isatty(STDIN_FILENO)) return;
+
+	__input.offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	__input.batch = __input.offset >= 0;
+}
+
+static ssize_t fill_input(void)
+{
+	size_t left = __input.tail - __input.head;
+	ssize_t len;
+
+	memmove(__input.buffer, __input.buffer + __input.head, left);
+	__input.head = 0;
+	__input.tail = left;
+
+	do {
+		len = pread(STDIN_FILENO, __input.buffer + left,
+				sizeof(__input.buffer) - left, __input.offset + left);
+	} while (len < 0 && errno == EINTR);
+
+	if (len > 0) __input.tail += len;
+
+	return len;
+}
+
+/***********************************************************************
+ * read_input()
+ *
+ * DESCRIPTION
+ *   getline() on the input buffer; read a whole line into *@line, which
+ *   is grown as needed and updated along with *@size.
+ *
+ * RETURN VALUE
+ *   Return the length of the line
+ *   Return -1 at the end of the input
+ */
+static ssize_t read_input(char **line, size_t *size)
+{
+	size_t len = 0;
+
+	while (true) {
+		char *start = __input.buffer + __input.head;
+		char *eol = memchr(start, '\n', __input.tail - __input.head);
+		size_t n = eol ? (size_t)(eol - start) + 1 : __input.tail - __input.head;
+
+		if (len + n + 1 > *size) {
+			size_t new_size = *size * 2 > len + n + 1 ? *size * 2 : len + n + 1;
+			char *new_line = realloc(*line, new_size);
+
+			if (!new_line) return -1;
+			*line = new_line;
+			*size = new_size;
+		}
+		memcpy(*line + len, start, n);
+		len += n;
+		__input.head += n;
+		__input.offset += n;
+
+		if (eol || fill_input() <= 0) break;
+	}
+
+	if (len == 0) return -1;
+	(*line)[len] = '\0';
+
+	return len;
+}
+
+static ssize_t read_command(char **line, size_t *size)
+{
+	if (__input.batch) return read_input(line, size);
+
+	return getline(line, size, stdin);
+}
+
+/* Hand the unread input over to children */
+static void sync_input(void)
+{
+	if (__input.batch) lseek(STDIN_FILENO, __input.offset, SEEK_SET);
+}
+
+/* Take back the input after children, which might have consumed some */
+static void resync_input(void)
+{
+	off_t offset;
+
+	if (!__input.batch) return;
+
+	offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if (offset < 0 || offset == __input.offset) return;
+
+	__input.offset = offset;
+	__input.head = __input.tail = 0;
+}
+
+
+/***********************************************************************
+ * struct pipeline
+ *
+ * DESCRIPTION
+ *   A command line split at every "|" into stages. Each stage's argv
+ *   points straight into the caller's tokens[]; the "|" slots are
+ *   overwritten with NULL so that every stage is NULL-terminated. The
+ *   stage array is grown on demand and reused for every command.
+ *
+ *   A pipeline may end in a fan-out, "|& { a , b , c }", where the output
+ *   of the stage before "|&" goes to every one of the branches. Branches
+ *   are the stages from @fan_out on, each fed by a pipe of its own.
+ *
+ *   It may also start with a fan-in, "{ a ; b ; c } | d", where the first
+ *   @nr_producers stages run at once and all write into the pipe of the
+ *   last of them.
+ *
+ *   Redirections of a stage are taken out of its argv and applied in the
+ *   child after the pipes, so they take precedence over them.
+ */
+struct redirection {
+	const char *in;		/* < file */
+	const char *out;	/* > file or >> file */
+	const char *err;	/* 2> file */
+	bool append;
+	bool err_to_out;	/* 2>&1 */
+	bool splice;		/* <| file */
+	int here;		/* Sealed memfd of "<<<" or "<<", or -1 */
+};
+
+struct stage {
+	char **argv;
+	struct redirection redir;
+	const char *path;	/* Resolved executable of argv[0] */
+	int pipe[2];		/* To the next stage */
+	pid_t pid;
+	int status;
+	int report;		/* fork_stage()'s report pipe until settle_stage(), or -1 */
+	uint64_t start;		/* When it was launched */
+	uint64_t end;		/* When it was reaped */
+	uint64_t hash;		/* Of argv, for the flight recorder */
+	struct rusage rusage;	/* From wait4() */
+};
+
+struct pipeline {
+	int nr_stages;
+	int nr_started;	/* Stages start_pipeline() got to */
+	int fan_out;	/* First branch of the fan-out, or @nr_stages */
+	int feed[2];	/* File and pipe to splice() for "<|", or -1 */
+	int nr_producers;	/* Stages of the fan-in, 1 without one */
+	int size;
+	struct stage *stages;
+};
+
+static struct pipeline __pipeline;
+
+static struct stage *add_stage(struct pipeline *pipeline, char **argv)
+{
+	if (pipeline->nr_stages == pipeline->size) {
+		int size = pipeline->size ? pipeline->size * 2 : 8;
+		struct stage *stages = realloc(pipeline->stages, sizeof(*stages) * size);
+
+		if (!stages) return NULL;
+		pipeline->stages = stages;
+		pipeline->size = size;
+	}
+	pipeline->stages[pipeline->nr_stages].argv = argv;
+	memset(&pipeline->stages[pipeline->nr_stages].redir, 0, sizeof(struct redirection));
+	pipeline->stages[pipeline->nr_stages].redir.here = -1;
+
+	return pipeline->stages + pipeline->nr_stages++;
+}
+
+/***********************************************************************
+ * build_pipeline()
+ *
+ * DESCRIPTION
+ *   Split @tokens into the stages of @pipeline in a single pass. Only an
+ *   unquoted "|" separates stages, and so do "|&", "{", "," and "}" of a
+ *   fan-out, which must be separate tokens and end the command, and "{",
+ *   ";" and "}" of a fan-in, which must start it and be followed by "|"
+ *   or "|&". A ";" may follow the last producer, as in sh(1).
+ *
+ *   Redirections, "< file", "> file", ">> file", "2> file", "2>&1" and
+ *   "<| file", may be anywhere in a stage, with or without a space before
+ *   the file. They are moved out of the way by packing the remaining
+ *   tokens down in place. So are here-strings, "<<< word", and
+ *   here-documents, "<< END", whose body is read off the input up to a
+ *   line of END right away; both end up in a memfd (see open_here()).
+ *
+ * RETURN VALUE
+ *   Return 0 on success
+ *   Return -EINVAL if a stage is empty (e.g., "a | | b" or "a |"), the
+ *   fan-out or fan-in is malformed, or a redirection has no file, and set
+ *   @__syntax_error to the offending token
+ *   Return -ENOMEM if the stages do not fit
+ *   Return <0 if a here-document could not be made
+ */
+static const char *__syntax_error = NULL;
+
+static const char * const __redirections[] = { "<<<", "<<", "<|", "<", ">>", ">", "2>" };
+
+static ssize_t write_all(int fd, const char *buffer, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		if ((n = write(fd, buffer + done, len - done)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * The text of a here-string or here-document is written once into an
+ * anonymous memfd, which is then sealed and rewound so that the child
+ * gets it as a plain read-only stdin. Unlike a pipe, it cannot fill up
+ * before the child runs, and nothing lands on disk.
+ */
+static int open_here(void)
+{
+	return memfd_create("here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+static int seal_here(int fd)
+{
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+			lseek(fd, 0, SEEK_SET) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static ssize_t read_command(char **line, size_t *size);
+
+/* Copy the input lines up to a line of @end into @fd, or drop them if @fd < 0 */
+static int read_here_document(int fd, const char *end)
+{
+	size_t len = strlen(end), size = 0;
+	char *line = NULL;
+	ssize_t n;
+	int ret = 0;
+
+	while (true) {
+		if (__verbose) fprintf(stderr, "> ");
+		if ((n = read_command(&line, &size)) < 0) {
+			fprintf(stderr, "Here-document ended before %s\n", end);
+			break;
+		}
+		if ((size_t)n >= len && strncmp(line, end, len) == 0 &&
+				(line[len] == '\0' || line[len] == '\n'))
+			break;
+		if (fd >= 0 && write_all(fd, line, n) < 0) {
+			ret = -errno;
+			break;
+		}
+	}
+	free(line);
+
+	return ret;
+}
+
+static int make_here(struct redirection *redir, const char *word, bool document)
+{
+	int fd, ret;
+
+	if ((fd = open_here()) < 0) {
+		ret = -errno;
+		goto error;
+	}
+	if (document) {
+		ret = read_here_document(fd, word);
+	} else if (write_all(fd, word, strlen(word)) < 0 || write_all(fd, "\n", 1) < 0) {
+		ret = -errno;
+	} else {
+		ret = 0;
+	}
+	if (!ret) ret = seal_here(fd);
+	if (ret < 0) {
+		close(fd);
+		goto error;
+	}
+
+	if (redir->here >= 0) close(redir->here);
+	redir->here = fd;
+	redir->in = NULL;
+	return 1;
+error:
+	fprintf(stderr, "Unable to make a here-%s: %s\n",
+			document ? "document" : "string", strerror(-ret));
+	return ret;
+}
+
+/* Close the here-documents of @pipeline once the children have them */
+static void close_heres(struct pipeline *pipeline)
+{
+	for (int i = 0; i < pipeline->nr_stages; i++) {
+		if (pipeline->stages[i].redir.here >= 0) {
+			close(pipeline->stages[i].redir.here);
+			pipeline->stages[i].redir.here = -1;
+		}
+	}
+}
+
+/**
+ * The redirection operator @tokens[@i] starts with, or NULL. The operator
+ * itself must be unquoted, but the file stuck to it may be quoted, as in
+ * >"my file" or <<<'a b'.
+ */
+static const char *redirection_op(struct tokens *vector, int i)
+{
+	const char *token = vector->tokens[i];
+	size_t plain = vector->quoted[i] ? vector->quoted[i] - 1 : strlen(token);
+
+	for (unsigned int j = 0; j < sizeof(__redirections) / sizeof(*__redirections); j++) {
+		size_t len = strlen(__redirections[j]);
+
+		if (len <= plain && strncmp(token, __redirections[j], len) == 0)
+			return __redirections[j];
+	}
+	return NULL;
+}
+
+/* Whether @tokens[@i] is an operator rather than the file of a redirection */
+static bool is_control(struct tokens *vector, int i)
+{
+	static const char * const controls[] = { "|", "|&", ";", "}", "&", "2>&1" };
+
+	for (unsigned int j = 0; j < sizeof(controls) / sizeof(*controls); j++) {
+		if (is_operator(vector, i, controls[j])) return true;
+	}
+	return redirection_op(vector, i) != NULL;
+}
+
+/* Apply the redirection at @tokens[*@i] to @redir if there is one */
+static int parse_redirection(struct tokens *vector, int *i, struct redirection *redir)
+{
+	const char *token = vector->tokens[*i], *file;
+	const char *op;
+
+	if (is_operator(vector, *i, "2>&1")) {
+		redir->err_to_out = true;
+		return 1;
+	}
+	if (!(op = redirection_op(vector, *i))) return 0;
+
+	if (token[strlen(op)]) {
+		file = token + strlen(op);
+	} else if (!vector->tokens[*i + 1] || is_control(vector, *i + 1)) {
+		__syntax_error = vector->tokens[*i + 1] ? vector->tokens[*i + 1] : op;
+		return -EINVAL;
+	} else {
+		file = vector->tokens[++*i];
+	}
+
+	if (strncmp(op, "<<", 2) == 0) return make_here(redir, file, op[2] != '<');
+
+	if (op[0] == '<') {
+		if (redir->here >= 0) close(redir->here);
+		redir->here = -1;
+		redir->in = file;
+		redir->splice = op[1] == '|';
+	} else if (op[0] == '>') {
+		redir->out = file;
+		redir->append = op[1] == '>';
+	} else {
+		redir->err = file;
+		redir->err_to_out = false;
+	}
+	return 1;
+}
+
+/**
+ * Built-ins run before build_pipeline() and take no redirections, but the
+ * body of a here-document still has to be read off the input, or its
+ * lines would run as commands. Return how many bodies were dropped.
+ */
+static int discard_here_documents(struct tokens *vector)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < vector->nr_tokens; i++) {
+		const char *op = redirection_op(vector, i);
+		const char *end = vector->tokens[i] + 2;
+
+		if (!op || strcmp(op, "<<") != 0) continue;
+		if (!*end) {
+			if (!vector->tokens[i + 1] || is_control(vector, i + 1)) continue;
+			end = vector->tokens[++i];
+		}
+		read_here_document(-1, end);
+		nr++;
+	}
+	return nr;
+}
+
+static bool is_built_in(const char *name)
+{
+	static const char * const built_ins[] = {
+		"history", "!", "hash", "jobs", "wait", "parallel",
+		"stats", "pipesize", "allocs", "cd",
+	};
+
+	for (unsigned int i = 0; i < sizeof(built_ins) / sizeof(*built_ins); i++) {
+		if (strcmp(name, built_ins[i]) == 0) return true;
+	}
+	return false;
+}
+
+static int build_pipeline(struct pipeline *pipeline, struct tokens *vector)
+{
+	int nr_tokens = vector->nr_tokens;
+	char **tokens = vector->tokens;
+	bool group = is_operator(vector, 0, "{");
+	bool fan_out = false, closed = false;
+	int i, w = 0, ret;
+
+	pipeline->nr_stages = 0;
+	pipeline->nr_producers = 1;
+	__syntax_error = "|";
+	if (!add_stage(pipeline, tokens)) return -ENOMEM;
+
+	for (i = group; i < nr_tokens; i++) {
+		struct stage *stage = pipeline->stages + pipeline->nr_stages - 1;
+		bool pipe = is_operator(vector, i, "|");
+		bool fork_out = is_operator(vector, i, "|&");
+		bool branch = fan_out && (is_operator(vector, i, ",") || is_operator(vector, i, "}"));
+		bool producer = group && (is_operator(vector, i, ";") || is_operator(vector, i, "}"));
+
+		if (!pipe && !fork_out && !branch && !producer) {
+			if ((ret = parse_redirection(vector, &i, &stage->redir)) < 0) return ret;
+			/* Redirections of a stage other than the first would override its pipe */
+			if (stage->redir.splice && stage != pipeline->stages) {
+				__syntax_error = "<|";
+				return -EINVAL;
+			}
+			if (!ret) tokens[w++] = tokens[i];
+			continue;
+		}
+
+		__syntax_error = tokens[i];
+		if (stage->argv == tokens + w) {
+			/* Drop what follows a trailing ";" of the fan-in */
+			if (!producer || !is_operator(vector, i, "}") || pipeline->nr_stages == 1)
+				return -EINVAL;
+			if (stage->redir.here >= 0) close(stage->redir.here);
+			pipeline->nr_stages--;
+		}
+		/* Producers and branches are single commands */
+		if (group && !producer) return -EINVAL;
+		if (fan_out && !branch) return -EINVAL;
+
+		if (producer) {
+			if (is_operator(vector, i, ";")) {
+				tokens[w++] = NULL;
+				if (!add_stage(pipeline, tokens + w)) return -ENOMEM;
+				continue;
+			}
+			/* Alone, a group would run all at once rather than in turn */
+			if (!is_operator(vector, i + 1, "|") && !is_operator(vector, i + 1, "|&"))
+				return -EINVAL;
+			pipeline->nr_producers = pipeline->nr_stages;
+			group = false;
+			continue;
+		}
+
+		if (fork_out) {
+			if (!is_operator(vector, i + 1, "{")) return -EINVAL;
+			fan_out = true;
+			pipeline->fan_out = pipeline->nr_stages;
+			i++;
+		} else if (is_operator(vector, i, "}")) {
+			if (i != nr_tokens - 1) return -EINVAL;
+			closed = true;
+			break;
+		}
+
+		tokens[w++] = NULL;
+		if (!add_stage(pipeline, tokens + w)) return -ENOMEM;
+	}
+	if ((fan_out && !closed) || group) {
+		__syntax_error = "{";
+		return -EINVAL;
+	}
+	if (!closed && pipeline->stages[pipeline->nr_stages - 1].argv == tokens + w)
+		return -EINVAL;
+	tokens[w] = NULL;
+
+	if (!fan_out) pipeline->fan_out = pipeline->nr_stages;
+
+	return 0;
+}
+
+static void close_pipes(struct pipeline *pipeline, int from, int to)
+{
+	for (int i = from; i < to; i++) {
+		close(pipeline->stages[i].pipe[0]);
+		close(pipeline->stages[i].pipe[1]);
+	}
+}
+
+/***********************************************************************
+ * Pipe capacity
+ *
+ * DESCRIPTION
+ *   With the default 64 KB, a fast producer fills the pipe in a moment
+ *   and the two ends take turns sleeping on each other. "pipesize N" or
+ *   "-P N", with an optional k or m suffix, makes the pipes of later
+ *   pipelines N bytes with F_SETPIPE_SZ. N is capped at what unprivileged
+ *   users may ask for, /proc/sys/fs/pipe-max-size, and 0 goes back to the
+ *   default. When the kernel refuses the size, e.g., because the user is
+ *   over /proc/sys/fs/pipe-user-pages-soft, the pipe keeps its default.
+ */
+static long __pipe_size = 0;
+
+static long pipe_max_size(void)
+{
+	static long max_size = 0;
+	FILE *fp;
+
+	if (max_size) return max_size;
+
+	max_size = 1 << 20;
+	if ((fp = fopen("/proc/sys/fs/pipe-max-size", "r"))) {
+		if (fscanf(fp, "%ld", &max_size) != 1) max_size = 1 << 20;
+		fclose(fp);
+	}
+	return max_size;
+}
+
+static int set_pipe_size(const char *value)
+{
+	char *end;
+	long size = strtol(value, &end, 10);
+
+	if (end == value || size < 0) return -EINVAL;
+
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+	if (*end != '\0') return -EINVAL;
+
+	__pipe_size = size < pipe_max_size() ? size : pipe_max_size();
+
+	return 0;
+}
+
+static int pipesize_command(int nr_tokens, char *tokens[])
+{
+	if (nr_tokens == 1) {
+		if (__pipe_size) {
+			fprintf(stderr, "%ld\n", __pipe_size);
+		} else {
+			fprintf(stderr, "default\n");
+		}
+		return 1;
+	}
+	if (set_pipe_size(tokens[1]))
+		fprintf(stderr, "Usage: pipesize [bytes[k|m]]\n");
+
+	return 1;
+}
+
+/***********************************************************************
+ * Launch backends
+ *
+ * DESCRIPTION
+ *   fork_stage() duplicates the shell and sets up the pipe ends in the
+ *   child before execv(). spawn_stage() expresses the same dup2 setup
+ *   as posix_spawn file actions, so the child never copies the shell's
+ *   page tables. Pick one with "-l fork" or "-l spawn". Pipes are
+ *   close-on-exec, so the children need not close them one by one.
+ *   @in, @out and @err become stdin, stdout and stderr of the child, and
+ *   -1 leaves the shell's own in place.
+ *
+ * RETURN VALUE
+ *   Return 0 when the stage has been started, and set @stage->pid
+ *   Return -errno otherwise
+ */
+enum launch_mode {
+	LAUNCH_FORK,
+	LAUNCH_SPAWN,
+};
+static enum launch_mode __launch_mode = LAUNCH_SPAWN;
+
+/**
+ * An executable without a "#!" line makes execv() and posix_spawn() fail
+ * with ENOEXEC. execvp() runs it with /bin/sh then, and so do we: fill
+ * @sh_argv, which has room for two more entries than @argv, with
+ * "/bin/sh @path @argv[1]...".
+ */
+static int nr_args(char * const argv[])
+{
+	int nr = 0;
+
+	while (argv[nr]) nr++;
+
+	return nr;
+}
+
+static char **script_argv(char **sh_argv, const char *path, char * const argv[])
+{
+	int i = 1;
+
+	sh_argv[0] = "/bin/sh";
+	sh_argv[1] = (char *)path;
+	while ((sh_argv[i + 1] = argv[i])) i++;
+
+	return sh_argv;
+}
+
+/**
+ * Files of redirections are opened in the child, after the dup2()s of the
+ * pipes, so that a FIFO blocks that stage alone rather than the shell
+ * before the stages reading the other end have started.
+ */
+static bool has_files(struct redirection *redir)
+{
+	return (redir->in && !redir->splice) || redir->out || redir->err;
+}
+
+static int redirect(int fd, const char *path, int flags)
+{
+	int file = open(path, flags, 0666);
+
+	if (file < 0) return errno;
+	if (file != fd) {
+		if (dup2(file, fd) < 0) return errno;
+		close(file);
+	}
+	return 0;
+}
+
+/* Open the files @redir names in the child; return 0 or errno */
+static int apply_redirection(struct redirection *redir)
+{
+	int error = 0;
+
+	if (redir->in && !redir->splice)
+		error = redirect(STDIN_FILENO, redir->in, O_RDONLY);
+	if (!error && redir->here >= 0 && dup2(redir->here, STDIN_FILENO) < 0)
+		error = errno;
+	if (!error && redir->out)
+		error = redirect(STDOUT_FILENO, redir->out,
+				O_WRONLY | O_CREAT | (redir->append ? O_APPEND : O_TRUNC));
+	if (!error && redir->err)
+		error = redirect(STDERR_FILENO, redir->err, O_WRONLY | O_CREAT | O_TRUNC);
+	if (!error && redir->err_to_out && dup2(STDOUT_FILENO, STDERR_FILENO) < 0)
+		error = errno;
+
+	return error;
+}
+
+/* execv() @stage, or /bin/sh with it on ENOEXEC; return errno on failure */
+static int exec_argv(struct stage *stage)
+{
+	execv(stage->path, stage->argv);
+	if (errno == ENOEXEC) {
+		char *sh_argv[nr_args(stage->argv) + 2];
+
+		execv("/bin/sh", script_argv(sh_argv, stage->path, stage->argv));
+	}
+	return errno;
+}
+
+/**
+ * The child of fork_stage() sends errno over a close-on-exec pipe if
+ * execv() fails, so the shell learns about the failure, and when the
+ * exec happened, just like posix_spawn() tells it. For a stage that opens
+ * files, the report is left in @stage->report for settle_stage() to read
+ * once the rest of the pipeline has started.
+ */
+static int fork_stage(struct stage *stage, int in, int out, int err)
+{
+	int report[2], error = 0;
+
+	if (pipe2(report, O_CLOEXEC) < 0) return -errno;
+
+	stage->pid = fork();
+	if (stage->pid < 0) {
+		error = errno;
+		close(report[0]);
+		close(report[1]);
+		return -error;
+	}
+	__stats.nr_forks++;
+
+	if (stage->pid == 0) {
+		if (in >= 0) dup2(in, STDIN_FILENO);
+		if (out >= 0) dup2(out, STDOUT_FILENO);
+		if (err >= 0) dup2(err, STDERR_FILENO);
+
+		if (!(error = apply_redirection(&stage->redir))) error = exec_argv(stage);
+		write(report[1], &error, sizeof(error));
+		_exit(EXIT_FAILURE);
+	}
+	close(report[1]);
+
+	/* Opening a FIFO waits for the other end, which may be a later stage */
+	if (has_files(&stage->redir)) {
+		stage->report = report[0];
+		return 0;
+	}
+
+	while (read(report[0], &error, sizeof(error)) < 0 && errno == EINTR);
+	close(report[0]);
+
+	if (error) {
+		waitpid(stage->pid, NULL, 0);
+		stage->pid = -1;
+	}
+	return -error;
+}
+
+/**
+ * File actions only depend on the pipe ends a stage gets, and the kernel
+ * hands out the same descriptors for the same shape of pipeline. Keep
+ * them around so that glibc does not allocate them for every stage.
+ */
+#define NR_SPAWN_ACTIONS	16
+
+static struct spawn_actions {
+	bool valid;
+	int in;
+	int out;
+	int err;
+	posix_spawn_file_actions_t actions;
+} __spawn_actions[NR_SPAWN_ACTIONS];
+
+static int add_spawn_dup2s(posix_spawn_file_actions_t *actions, int in, int out, int err)
+{
+	if ((in >= 0 && posix_spawn_file_actions_adddup2(actions, in, STDIN_FILENO)) ||
+		(out >= 0 && posix_spawn_file_actions_adddup2(actions, out, STDOUT_FILENO)) ||
+		(err >= 0 && posix_spawn_file_actions_adddup2(actions, err, STDERR_FILENO)))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static posix_spawn_file_actions_t *get_spawn_actions(int in, int out, int err)
+{
+	struct spawn_actions *sa = __spawn_actions +
+			(((in + 1) * 31 + out + 1) * 31 + err + 1) % NR_SPAWN_ACTIONS;
+
+	if (sa->valid && sa->in == in && sa->out == out && sa->err == err)
+		return &sa->actions;
+
+	if (sa->valid) posix_spawn_file_actions_destroy(&sa->actions);
+	sa->valid = false;
+
+	if (posix_spawn_file_actions_init(&sa->actions)) return NULL;
+	if (add_spawn_dup2s(&sa->actions, in, out, err)) {
+		posix_spawn_file_actions_destroy(&sa->actions);
+		return NULL;
+	}
+	sa->in = in;
+	sa->out = out;
+	sa->err = err;
+	sa->valid = true;
+
+	return &sa->actions;
+}
+
+static void free_spawn_actions(void)
+{
+	for (int i = 0; i < NR_SPAWN_ACTIONS; i++) {
+		if (__spawn_actions[i].valid)
+			posix_spawn_file_actions_destroy(&__spawn_actions[i].actions);
+	}
+}
+
+static int spawn_argv(struct stage *stage, const posix_spawn_file_actions_t *actions)
+{
+	int ret;
+
+	__stats.nr_forks++;
+	ret = posix_spawn(&stage->pid, stage->path, actions, NULL, stage->argv, environ);
+	if (ret == ENOEXEC) {
+		char *sh_argv[nr_args(stage->argv) + 2];
+
+		__stats.nr_forks++;
+		ret = posix_spawn(&stage->pid, "/bin/sh", actions, NULL,
+				script_argv(sh_argv, stage->path, stage->argv), environ);
+	}
+	return -ret;
+}
+
+static int spawn_stage(struct stage *stage, int in, int out, int err)
+{
+	posix_spawn_file_actions_t *actions = NULL;
+
+
+	if ((in >= 0 || out >= 0 || err >= 0) && !(actions = get_spawn_actions(in, out, err)))
+		return -ENOMEM;
+
+	return spawn_argv(stage, actions);
+}
+
+/**
+ * A here-document and "2>&1" without a file are mere descriptors, so
+ * they are folded into @in and @err in the shell and the stage keeps the
+ * cached file actions. A here-document stays in @redir for the children
+ * that open files, where it has to come after "<".
+ */
+static void redirect_fds(struct redirection *redir, int *in, int *out, int *err)
+{
+	if (has_files(redir)) return;
+
+	if (redir->here >= 0) *in = redir->here;
+	if (redir->err_to_out) *err = *out >= 0 ? *out : STDOUT_FILENO;
+}
+
+/**
+ * The child only reports an errno when opening a file of @redir fails.
+ * Try the files again without creating or blocking, to name the one at
+ * fault in the error.
+ */
+static const char *blame_redirection(struct redirection *redir)
+{
+	const char *paths[] = { redir->splice ? NULL : redir->in, redir->out, redir->err };
+
+	for (int i = 0; i < 3; i++) {
+		int fd;
+
+		if (!paths[i]) continue;
+		fd = open(paths[i], (i ? O_WRONLY : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+		/* ENXIO is a FIFO no one reads yet, which the child waits for */
+		if (fd < 0 && errno != ENXIO) return paths[i];
+		if (fd >= 0) close(fd);
+	}
+	return NULL;
+}
+
+/* Resolve and start @stage with the backend in use */static int launch_failed(struct stage *stage, int error)
+{
+	const char *file;
+
+	stage->pid = -1;
+	if (has_files(&stage->redir) && (file = blame_redirection(&stage->redir))) {
+		fprintf(stderr, "Unable to open %s: %s\n", file, strerror(error));
+		return -EINVAL;
+	}
+	fprintf(stderr, "Unable to execute %s\n", stage->argv[0]);
+	forget_command(stage->argv[0]);
+	__stats.nr_exec_failures++;
+
+	return -EINVAL;
+}
+
+/**
+ * Resolve and start @stage with the backend in use. posix_spawn() only
+ * returns once the child has exec'd, so a stage that opens files always
+ * goes through fork_stage(), and settle_stage() must follow.
+ */
+static int launch_stage(struct stage *stage, int in, int out, int err)
+{
+	uint64_t start;
+	int ret;
+
+	stage->pid = -1;
+	stage->report = -1;
+	if (!(stage->path = resolve_command(stage->argv[0]))) {
+		fprintf(stderr, "Unable to execute %s\n", stage->argv[0]);
+		__stats.nr_exec_failures++;
+		return -EINVAL;
+	}
+
+	stage->hash = hash_argv(stage->argv);
+	stage->start = start = now_ns();
+	redirect_fds(&stage->redir, &in, &out, &err);
+
+	if (__launch_mode == LAUNCH_SPAWN && !has_files(&stage->redir)) {
+		ret = spawn_stage(stage, in, out, err);
+	} else {
+		ret = fork_stage(stage, in, out, err);
+	}
+	trace_span(TRACE_LAUNCH, start, record_latency(&__stats.launch, start),
+			0, stage->argv[0]);
+
+	if (ret < 0) return launch_failed(stage, -ret);
+	if (stage->report < 0) __stats.nr_execs++;
+
+	return 0;
+}
+
+/* Wait for the child of @stage to open its files and exec, if it has not */
+static int settle_stage(struct stage *stage)
+{
+	int error = 0;
+
+	if (stage->report < 0) return 0;
+
+	while (read(stage->report, &error, sizeof(error)) < 0 && errno == EINTR);
+	close(stage->report);
+	stage->report = -1;
+
+	if (error) {
+		waitpid(stage->pid, NULL, 0);
+		return launch_failed(stage, error);
+	}
+	__stats.nr_execs++;
+
+	return 0;
+}
+
+
+/***********************************************************************
+ * start_pipeline()
+ *
+ * DESCRIPTION
+ *   Create all pipes up front and start every stage of @pipeline at once.
+ *   Stage i reads from the pipe of stage i - 1 and writes to its own; the
+ *   first stage reads from @in, or the shell's stdin if it is -1.
+ *
+ * RETURN VALUE
+ *   Return 1 if every stage has been started
+ *   Return <0 otherwise
+ */
+static int start_pipeline(struct pipeline *pipeline, int in)
+{
+	int fan_out = pipeline->fan_out;
+	/* Producers of a fan-in share the pipe of the last one */
+	int nr_producers = pipeline->nr_producers;
+	/* With a fan-out, the last producer and every branch have a pipe */
+	int nr_pipes = fan_out < pipeline->nr_stages ? pipeline->nr_stages : pipeline->nr_stages - 1;
+	int i, ret = 1;
+
+	pipeline->nr_started = 0;
+	pipeline->feed[0] = pipeline->feed[1] = -1;
+
+	if (pipeline->stages[0].redir.splice) {
+		int feed[2];
+
+		if ((pipeline->feed[0] = open(pipeline->stages[0].redir.in, O_RDONLY | O_CLOEXEC)) < 0) {
+			ret = -errno;
+			fprintf(stderr, "Unable to open %s: %s\n", pipeline->stages[0].redir.in,
+					strerror(errno));
+			return ret;
+		}
+		if (pipe2(feed, O_CLOEXEC) < 0) {
+			ret = -errno;
+			close(pipeline->feed[0]);
+			return ret;
+		}
+		if (__pipe_size) fcntl(feed[1], F_SETPIPE_SZ, __pipe_size);
+		pipeline->feed[1] = feed[1];
+		in = feed[0];
+	}
+
+	for (i = nr_producers - 1; i < nr_pipes; i++) {
+		if (pipe2(pipeline->stages[i].pipe, O_CLOEXEC) < 0) {
+			ret = -errno;
+			close_pipes(pipeline, nr_producers - 1, i);
+			if (pipeline->feed[0] >= 0) {
+				close(in);
+				close(pipeline->feed[0]);
+				close(pipeline->feed[1]);
+				pipeline->feed[0] = pipeline->feed[1] = -1;
+			}
+			return ret;
+		}
+		if (__pipe_size)
+			fcntl(pipeline->stages[i].pipe[1], F_SETPIPE_SZ, __pipe_size);
+	}
+
+	for (i = 0; i < pipeline->nr_stages; i++) {
+		struct stage *stage = pipeline->stages + i;
+		int out = i < nr_pipes && i < fan_out ? stage->pipe[1] : -1;
+
+		if (i < nr_producers - 1) {
+			out = nr_producers - 1 < nr_pipes ? pipeline->stages[nr_producers - 1].pipe[1] : -1;
+		} else if (i >= fan_out) {
+			in = stage->pipe[0];
+		} else if (i >= nr_producers) {
+			in = stage[-1].pipe[0];
+		}
+
+		if (launch_stage(stage, in, out, -1) < 0) ret = -EINVAL;
+		/* Other producers of a fan-in read the shell's stdin, not the feed */
+		if (i == 0 && pipeline->feed[1] >= 0) {
+			close(in);
+			in = -1;
+		}
+	}
+	pipeline->nr_started = i;
+
+	for (i = 0; i < pipeline->nr_started; i++) {
+		if (settle_stage(pipeline->stages + i) < 0) ret = -EINVAL;
+	}
+
+	if (fan_out == pipeline->nr_stages) {
+		close_pipes(pipeline, nr_producers - 1, nr_pipes);
+		return ret;
+	}
+
+	/* Keep the ends the shell copies the fan-out through */
+	close_pipes(pipeline, nr_producers - 1, fan_out - 1);
+	close(pipeline->stages[fan_out - 1].pipe[1]);
+	for (i = fan_out; i < pipeline->nr_stages; i++)
+		close(pipeline->stages[i].pipe[0]);
+
+	return ret;
+}
+
+
+/***********************************************************************
+ * fan_out()
+ *
+ * DESCRIPTION
+ *   Copy all that comes out of @in to the pipe of each of @nr_branches,
+ *   without the data ever entering userspace. tee(2) duplicates what is
+ *   in @in into every branch but the last one, and splice(2) then moves it
+ *   into the last one. When a branch pipe is too full for tee() to take
+ *   all of it, the data is read out of @in instead, and what that branch
+ *   and the last one are missing is written from the buffer. A branch
+ *   that exits is dropped; the producer gets EPIPE when all of them have.
+ *   SIGPIPE is held off meanwhile so that it does not kill the shell.
+ *   All the pipes are closed on return.
+ */
+static void drop_branch(struct stage *branch)
+{
+	close(branch->pipe[1]);
+	branch->pipe[1] = -1;
+}
+
+/* Keep SIGPIPE off while the shell itself writes into pipes */
+static void hold_sigpipe(sigset_t *saved)
+{
+	sigset_t sigpipe;
+
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &sigpipe, saved);
+}
+
+static void release_sigpipe(const sigset_t *saved)
+{
+	const struct timespec zero = { 0 };
+	sigset_t sigpipe;
+
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	while (sigtimedwait(&sigpipe, NULL, &zero) > 0);
+	sigprocmask(SIG_SETMASK, saved, NULL);
+}
+
+static void fan_out(int in, struct stage *branches, int nr_branches)
+{
+	size_t chunk = fcntl(in, F_GETPIPE_SZ);
+	/* How much of the @n bytes at the head of @in each branch has got */
+	ssize_t got[nr_branches];
+	char *buffer = NULL;
+	sigset_t saved;
+	int i, first, last;
+	ssize_t n, m;
+
+	if ((ssize_t)chunk <= 0) chunk = 64 << 10;
+
+	hold_sigpipe(&saved);
+
+	while (true) {
+		bool copy = false;
+
+		for (first = 0; first < nr_branches && branches[first].pipe[1] < 0; first++);
+		for (last = nr_branches - 1; last >= first && branches[last].pipe[1] < 0; last--);
+		if (first > last) break;
+
+		if (first == last) {
+			n = splice(in, NULL, branches[last].pipe[1], NULL, chunk, SPLICE_F_MOVE);
+			if (n == 0) break;
+			if (n < 0 && errno != EINTR) drop_branch(branches + last);
+			continue;
+		}
+
+		if ((n = tee(in, branches[first].pipe[1], chunk, 0)) <= 0) {
+			if (n == 0) break;
+			if (errno != EINTR) drop_branch(branches + first);
+			continue;
+		}
+		got[first] = n;
+		for (i = first + 1; i < last; i++) {
+			if (branches[i].pipe[1] < 0) continue;
+			while ((m = tee(in, branches[i].pipe[1], n, 0)) < 0 && errno == EINTR);
+			if (m < 0) {
+				drop_branch(branches + i);
+				continue;
+			}
+			got[i] = m;
+			if (m < n) copy = true;
+		}
+
+		for (m = 0; !copy && m < n; ) {
+			ssize_t moved = splice(in, NULL, branches[last].pipe[1], NULL, n - m, SPLICE_F_MOVE);
+
+			if (moved < 0 && errno == EINTR) continue;
+			if (moved <= 0) {
+				drop_branch(branches + last);
+				/* The @m bytes spliced are gone from the head of @in */
+				for (i = first; i < last; i++) got[i] = got[i] > m ? got[i] - m : 0;
+				n -= m;
+				m = 0;
+				copy = true;
+				break;
+			}
+			m += moved;
+		}
+		if (!copy) continue;
+
+		/* Take the @n bytes out of @in and make up for what is missing */
+		if (!buffer && !(buffer = malloc(chunk))) break;
+		for (m = 0; m < n; ) {
+			ssize_t len = read(in, buffer + m, n - m);
+
+			if (len < 0 && errno == EINTR) continue;
+			if (len <= 0) break;
+			m += len;
+		}
+		n = m;
+		got[last] = 0;
+		for (i = first; i <= last; i++) {
+			if (branches[i].pipe[1] < 0 || got[i] >= n) continue;
+			if (write_all(branches[i].pipe[1], buffer + got[i], n - got[i]) < 0)
+				drop_branch(branches + i);
+		}
+	}
+
+	close(in);
+	for (i = 0; i < nr_branches; i++) {
+		if (branches[i].pipe[1] >= 0) drop_branch(branches + i);
+	}
+	free(buffer);
+
+	release_sigpipe(&saved);
+}
+
+/***********************************************************************
+ * feed_file()
+ *
+ * DESCRIPTION
+ *   Move the whole of @file into the pipe @out with splice(2), as
+ *   "cat file |" would but without the process, for "<| file". Stop when
+ *   the stage reading @out exits. Both descriptors are closed on return.
+ */
+static void feed_file(int file, int out)
+{
+	sigset_t saved;
+	ssize_t n;
+
+	hold_sigpipe(&saved);
+
+	while ((n = splice(file, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE)) != 0) {
+		if (n < 0 && errno != EINTR) break;
+	}
+	close(file);
+	close(out);
+
+	release_sigpipe(&saved);
+}
+
+
+/***********************************************************************
+ * run_pipeline()
+ *
+ * DESCRIPTION
+ *   Start @pipeline in the foreground and reap all of its stages.
+ *
+ * RETURN VALUE
+ *   Return 1 if every stage exited successfully
+ *   Return <0 otherwise
+ */
+static unsigned long __nr_dispatch_allocations = 0;
+
+static int run_pipeline(struct pipeline *pipeline)
+{
+	unsigned long nr_allocs = nr_allocations();
+	uint64_t start, end;
+	int ret;
+
+	sync_input();
+	ret = start_pipeline(pipeline, -1);
+
+	if (pipeline->feed[0] >= 0) feed_file(pipeline->feed[0], pipeline->feed[1]);
+	if (pipeline->fan_out < pipeline->nr_stages) {
+		fan_out(pipeline->stages[pipeline->fan_out - 1].pipe[0],
+				pipeline->stages + pipeline->fan_out,
+				pipeline->nr_stages - pipeline->fan_out);
+	}
+
+	/* Reap whatever has been started, even if a later fork() failed */
+	for (int i = 0; i < pipeline->nr_started; i++) {
+		struct stage *stage = pipeline->stages + i;
+
+		if (stage->pid < 0) continue;
+		start = now_ns();
+		wait4(stage->pid, &stage->status, 0, &stage->rusage);
+		stage->end = end = record_latency(&__stats.wait, start);
+		trace_span(TRACE_WAIT, start, end, 0, stage->argv[0]);
+		trace_span(TRACE_CHILD, stage->start, end, stage->pid, stage->argv[0]);
+		record_flight(stage->hash, stage->pid, stage->start, end,
+				stage->status, &stage->rusage);
+		if (!WIFEXITED(stage->status) || WEXITSTATUS(stage->status) != 0)
+			if (ret > 0) ret = -EINVAL;
+	}
+	resync_input();
+
+	__nr_dispatch_allocations += nr_allocations() - nr_allocs;
+
+	return ret;
+}
+
+
+/***********************************************************************
+ * Background jobs
+ *
+ * DESCRIPTION
+ *   A command ending in "&" is started and left running in a job, whose
+ *   stages are copied out of the pipeline so that the next command can
+ *   reuse it. As there is no job control, the first stage reads from
+ *   /dev/null, and the script input is left to the shell.
+ *
+ *   SIGCHLD only flags that something has exited. Children are reaped
+ *   by reap_jobs() between commands, never while a foreground pipeline
+ *   is waited for, so its stages are always there for it to collect.
+ *   Finished jobs are reported before the next prompt in interactive
+ *   mode, and kept until "jobs" or "wait" looks at them otherwise.
+ */
+struct job_stage {
+	pid_t pid;
+	int status;
+	uint64_t start;
+	uint64_t hash;
+	bool done;
+};
+
+struct job {
+	struct list_head list;
+	int id;
+	int nr_running;
+	bool failed;		/* Some stage could not be started */
+	char *command;		/* Points past @stages[] */
+	int nr_stages;
+	struct job_stage stages[];
+};
+
+static LIST_HEAD(__jobs);
+static volatile sig_atomic_t __sigchld = 0;
+static int __dev_null = -1;
+
+static int get_dev_null(void)
+{
+	if (__dev_null < 0) __dev_null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	return __dev_null;
+}
+
+static void sigchld_handler(int signal)
+{
+	__sigchld = 1;
+}
+
+static int init_jobs(void)
+{
+	struct sigaction sa = {
+		.sa_handler = sigchld_handler,
+		.sa_flags = SA_RESTART | SA_NOCLDSTOP,
+	};
+
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGCHLD, &sa, NULL);
+}
+
+static struct job *add_job(struct pipeline *pipeline)
+{
+	struct job *job;
+	size_t len = 0;
+	char *p;
+	int i;
+
+	for (i = 0; i < pipeline->nr_stages; i++) {
+		for (char **argv = pipeline->stages[i].argv; *argv; argv++)
+			len += strlen(*argv) + 1;
+		len += 2;
+	}
+
+	job = malloc(sizeof(*job) + sizeof(struct job_stage) * pipeline->nr_stages + len);
+	if (!job) return NULL;
+
+	job->id = list_empty(&__jobs) ? 1 : list_last_entry(&__jobs, struct job, list)->id + 1;
+	job->nr_running = 0;
+	job->failed = pipeline->nr_started < pipeline->nr_stages;
+	job->nr_stages = pipeline->nr_started;
+	job->command = p = (char *)(job->stages + pipeline->nr_stages);
+
+	for (i = 0; i < pipeline->nr_stages; i++) {
+		for (char **argv = pipeline->stages[i].argv; *argv; argv++) {
+			p = stpcpy(p, *argv);
+			*p++ = ' ';
+		}
+		if (i < pipeline->nr_producers - 1) {
+			p = stpcpy(p, "; ");
+		} else if (i < pipeline->nr_stages - 1) {
+			p = stpcpy(p, "| ");
+		}
+	}
+	p[-1] = '\0';
+
+	for (i = 0; i < job->nr_stages; i++) {
+		job->stages[i].pid = pipeline->stages[i].pid;
+		job->stages[i].start = pipeline->stages[i].start;
+		job->stages[i].hash = pipeline->stages[i].hash;
+		job->stages[i].done = pipeline->stages[i].pid < 0;
+		if (job->stages[i].done) {
+			job->failed = true;
+		} else {
+			job->nr_running++;
+		}
+	}
+	list_add_tail(&job->list, &__jobs);
+
+	return job;
+}
+
+static void finish_job_stage(struct job *job, struct job_stage *stage, int status,
+		const struct rusage *ru)
+{
+	uint64_t end = now_ns();
+
+	stage->status = status;
+	stage->done = true;
+	job->nr_running--;
+	trace_span(TRACE_CHILD, stage->start, end, stage->pid, job->command);
+	record_flight(stage->hash, stage->pid, stage->start, end, status, ru);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) job->failed = true;
+}
+
+/* Account the exit of @pid to the job it belongs to, if any */
+static void reap_job(pid_t pid, int status, const struct rusage *ru)
+{
+	struct job *job;
+
+	list_for_each_entry(job, &__jobs, list) {
+		for (int i = 0; i < job->nr_stages; i++) {
+			if (job->stages[i].pid == pid && !job->stages[i].done) {
+				finish_job_stage(job, job->stages + i, status, ru);
+				return;
+			}
+		}
+	}
+}
+
+static void reap_jobs(void)
+{
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	if (!__sigchld) return;
+	__sigchld = 0;
+
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+		reap_job(pid, status, &ru);
+}
+
+/* Block until every stage of @job has exited */
+static void wait_job(struct job *job)
+{
+	for (int i = 0; i < job->nr_stages; i++) {
+		struct job_stage *stage = job->stages + i;
+		struct rusage ru = { 0 };
+		int status;
+
+		if (stage->done) continue;
+		if (wait4(stage->pid, &status, 0, &ru) < 0) status = 0;
+		finish_job_stage(job, stage, status, &ru);
+	}
+}
+
+static void report_job(struct job *job)
+{
+	fprintf(stderr, "[%d] %-8s%s\n", job->id,
+			job->nr_running ? "Running" : job->failed ? "Exit" : "Done",
+			job->command);
+}
+
+/* Report the jobs that have finished and forget them */
+static void report_jobs(void)
+{
+	struct job *job, *tmp;
+
+	reap_jobs();
+
+	list_for_each_entry_safe(job, tmp, &__jobs, list) {
+		if (job->nr_running) continue;
+		report_job(job);
+		list_del(&job->list);
+		free(job);
+	}
+}
+
+static void free_jobs(void)
+{
+	struct job *job, *tmp;
+
+	list_for_each_entry_safe(job, tmp, &__jobs, list) {
+		list_del(&job->list);
+		free(job);
+	}
+	if (__dev_null >= 0) close(__dev_null);
+}
+
+static int run_background(struct pipeline *pipeline)
+{
+	struct job *job;
+	int ret;
+
+	if (get_dev_null() < 0) return -errno;
+
+	ret = start_pipeline(pipeline, __dev_null);
+
+	if (!(job = add_job(pipeline))) {
+		for (int i = 0; i < pipeline->nr_started; i++) {
+			if (pipeline->stages[i].pid > 0)
+				waitpid(pipeline->stages[i].pid, NULL, 0);
+		}
+		return -ENOMEM;
+	}
+	if (__verbose) fprintf(stderr, "[%d] %d\n", job->id,
+			job->nr_stages ? job->stages[job->nr_stages - 1].pid : -1);
+
+	return ret;
+}
+
+static struct job *find_job(const char *spec)
+{
+	struct job *job;
+	char *end;
+	long id = strtol(spec + (spec[0] == '%'), &end, 10);
+
+	if (*end != '\0') return NULL;
+
+	list_for_each_entry(job, &__jobs, list) {
+		if (job->id == id) return job;
+	}
+	return NULL;
+}
+
+/* jobs, wait [id ...] */
+static int jobs_command(int nr_tokens, char *tokens[])
+{
+	struct job *job, *tmp;
+
+	if (strcmp(tokens[0], "jobs") == 0) {
+		report_jobs();
+		list_for_each_entry(job, &__jobs, list)
+			report_job(job);
+		return 1;
+	}
+
+	reap_jobs();
+	if (nr_tokens == 1) {
+		list_for_each_entry_safe(job, tmp, &__jobs, list) {
+			wait_job(job);
+			if (job->failed) report_job(job);
+			list_del(&job->list);
+			free(job);
+		}
+		return 1;
+	}
+
+	for (int i = 1; i < nr_tokens; i++) {
+		if (!(job = find_job(tokens[i]))) {
+			fprintf(stderr, "No such job %s\n", tokens[i]);
+			continue;
+		}
+		wait_job(job);
+		if (job->failed) report_job(job);
+		list_del(&job->list);
+		free(job);
+	}
+	return 1;
+}
+
+
+/***********************************************************************
+ * parallel_command()
+ *
+ * DESCRIPTION
+ *   parallel [-j N] command [args ...] ::: arg ...
+ *
+ *   Run the command once for every argument after ":::", with "{}" in
+ *   the command replaced by the argument or the argument appended if
+ *   there is none. Keep up to N of them running, the number of online
+ *   CPUs by default, and start the next one whenever any exits. Each
+ *   slot captures the stdout and stderr of its job in a pair of memfds,
+ *   which are copied out as a whole when the job exits, so outputs come
+ *   out job by job in the order the jobs finish.
+ */
+struct parallel_slot {
+	struct stage stage;
+	int out;
+	int err;
+};
+
+static void flush_slot_output(int fd, int to)
+{
+	off_t size = lseek(fd, 0, SEEK_CUR), offset = 0;
+	char buffer[4096];
+	ssize_t len;
+
+	while (offset < size) {
+		if (sendfile(to, fd, &offset, size - offset) <= 0) break;
+	}
+	/* sendfile() cannot write to every file, e.g., one in O_APPEND mode */
+	while (offset < size && (len = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+		if (write(to, buffer, len) != len) break;
+		offset += len;
+	}
+	ftruncate(fd, 0);
+	lseek(fd, 0, SEEK_SET);
+}
+
+static int start_slot(struct parallel_slot *slot, char *template[], int nr_template,
+		char *arg)
+{
+	struct stage *stage = &slot->stage;
+	bool replaced = false;
+	int i;
+
+	for (i = 0; i < nr_template; i++) {
+		if (strcmp(template[i], "{}") == 0) {
+			stage->argv[i] = arg;
+			replaced = true;
+		} else {
+			stage->argv[i] = template[i];
+		}
+	}
+	if (!replaced) stage->argv[i++] = arg;
+	stage->argv[i] = NULL;
+
+	if (launch_stage(stage, __dev_null, slot->out, slot->err) < 0) return -EINVAL;
+
+	return settle_stage(stage);
+}
+
+static int parallel_command(int nr_tokens, char *tokens[])
+{
+	long nr_slots = sysconf(_SC_NPROCESSORS_ONLN);
+	struct parallel_slot *slots;
+	char **argv, **template, **args, *end;
+	int first = 1, sep, nr_template, nr_args, next = 0;
+	int nr_running = 0, nr_failed = 0;
+	int s, status;
+	struct rusage ru;
+	pid_t pid;
+
+	if (nr_tokens > 1 && strncmp(tokens[1], "-j", 2) == 0) {
+		const char *value = tokens[1][2] ? tokens[1] + 2 : tokens[2];
+
+		first = tokens[1][2] ? 2 : 3;
+		if (!value || (nr_slots = strtol(value, &end, 10)) <= 0 || *end) first = nr_tokens;
+	}
+	for (sep = first; sep < nr_tokens && strcmp(tokens[sep], ":::") != 0; sep++);
+
+	if (sep == first || sep >= nr_tokens) {
+		fprintf(stderr, "Usage: parallel [-j N] command [args ...] ::: arg ...\n");
+		return 1;
+	}
+	template = tokens + first;
+	nr_template = sep - first;
+	args = tokens + sep + 1;
+	nr_args = nr_tokens - sep - 1;
+
+	if (nr_slots < 1) nr_slots = 1;
+	if (nr_slots > nr_args) nr_slots = nr_args;
+	if (nr_args == 0) return 1;
+
+	if (get_dev_null() < 0) return -errno;
+
+	slots = calloc(nr_slots, sizeof(*slots));
+	argv = calloc(nr_slots * (nr_template + 2), sizeof(*argv));
+	if (!slots || !argv) {
+		free(slots);
+		free(argv);
+		return -ENOMEM;
+	}
+
+	for (s = 0; s < nr_slots; s++) {
+		slots[s].stage.argv = argv + s * (nr_template + 2);
+		slots[s].stage.pid = -1;
+		slots[s].stage.redir.here = -1;
+		slots[s].out = memfd_create("parallel-out", MFD_CLOEXEC);
+		slots[s].err = memfd_create("parallel-err", MFD_CLOEXEC);
+		if (slots[s].out < 0 || slots[s].err < 0) {
+			fprintf(stderr, "Unable to capture outputs\n");
+			nr_slots = s + 1;
+			next = nr_args;
+			break;
+		}
+	}
+
+	while (true) {
+		for (s = 0; s < nr_slots; s++) {
+			while (slots[s].stage.pid < 0 && next < nr_args) {
+				if (start_slot(slots + s, template, nr_template, args[next++]) < 0) {
+					nr_failed++;
+				} else {
+					nr_running++;
+				}
+			}
+		}
+		if (!nr_running) break;
+
+		if ((pid = wait4(-1, &status, 0, &ru)) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		for (s = 0; s < nr_slots && slots[s].stage.pid != pid; s++);
+		if (s == nr_slots) {
+			/* One of the background jobs */
+			reap_job(pid, status, &ru);
+			continue;
+		}
+
+		trace_span(TRACE_CHILD, slots[s].stage.start, now_ns(), pid, slots[s].stage.argv[0]);
+		record_flight(slots[s].stage.hash, pid, slots[s].stage.start,
+				now_ns(), status, &ru);
+		flush_slot_output(slots[s].out, STDOUT_FILENO);
+		flush_slot_output(slots[s].err, STDERR_FILENO);
+		slots[s].stage.pid = -1;
+		nr_running--;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) nr_failed++;
+	}
+
+	for (s = 0; s < nr_slots; s++) {
+		if (slots[s].out >= 0) close(slots[s].out);
+		if (slots[s].err >= 0) close(slots[s].err);
+	}
+	free(slots);
+	free(argv);
+
+	if (nr_failed) fprintf(stderr, "parallel: %d of %d jobs failed\n", nr_failed, nr_args);
+
+	return 1;
+}
+
+
+/***********************************************************************
+ * exec_stage()
+ *
+ * DESCRIPTION
+ *   Replace the shell with @stage, redirections and all, rather than
+ *   running it in a child. The rest of the input is handed over, and the
+ *   trace and the history files are flushed and closed, since finalize()
+ *   never gets to run. Background jobs become children of the command.
+ *
+ * RETURN VALUE
+ *   Return -EINVAL if the command cannot be found, and the shell carries on
+ *   Exit the shell if the redirections or execv() fail past that point
+ */
+static void close_history_file(void);
+static void close_shared_history(void);
+
+static int exec_stage(struct stage *stage)
+{
+	int error;
+
+	if (!(stage->path = resolve_command(stage->argv[0]))) {
+		fprintf(stderr, "Unable to execute %s\n", stage->argv[0]);
+		__stats.nr_exec_failures++;
+		return -EINVAL;
+	}
+	sync_input();
+	flush_trace();
+	close_history_file();
+	close_shared_history();
+	fflush(NULL);
+
+	if ((error = apply_redirection(&stage->redir))) {
+		const char *file = blame_redirection(&stage->redir);
+
+		if (file) {
+			fprintf(stderr, "Unable to open %s: %s\n", file, strerror(error));
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		error = exec_argv(stage);
+	}
+	fprintf(stderr, "Unable to execute %s: %s\n", stage->argv[0], strerror(error));
+	exit(EXIT_FAILURE);
+}
+
+/***********************************************************************
+ * exec_command()
+ *
+ * DESCRIPTION
+ *   exec command [args] [redirections]
+ *
+ *   Replace the shell with a single command. A bare "exec" does nothing.
+ */
+static int exec_command(struct tokens *vector)
+{
+	struct pipeline *pipeline = &__pipeline;
+	int ret;
+
+	memmove(vector->tokens, vector->tokens + 1, sizeof(char *) * vector->nr_tokens);
+	memmove(vector->quoted, vector->quoted + 1, sizeof(*vector->quoted) * (vector->nr_tokens - 1));
+	if (--vector->nr_tokens == 0) return 1;
+
+	/* build_pipeline() packs the tokens down, so look for "&" before */
+	for (int i = 0; i < vector->nr_tokens; i++) {
+		if (is_operator(vector, i, "&")) {
+			fprintf(stderr, "exec takes a single foreground command\n");
+			return -EINVAL;
+		}
+	}
+
+	if ((ret = build_pipeline(pipeline, vector)) < 0) {
+		if (ret == -EINVAL) fprintf(stderr, "Syntax error near %s\n", __syntax_error);
+		goto out;
+	}
+
+	if (pipeline->nr_stages > 1 || pipeline->stages[0].redir.splice) {
+		fprintf(stderr, "exec takes a single foreground command\n");
+		ret = -EINVAL;
+	} else {
+		ret = exec_stage(pipeline->stages);
+	}
+out:
+	close_heres(pipeline);
+	return ret;
+}
+
+/**
+ * With -e, a script that ends in a plain command execs it in place of
+ * the shell, which would only wait for it and exit. @__last_command is
+ * set while the line that the input ends with is run.
+ */
+static bool __tail_exec = false;
+static bool __last_command = false;
+
+/* Whether nothing follows the line just read; only batch input can tell */
+static bool end_of_input(void)
+{
+	if (!__input.batch) return false;
+
+	return __input.head == __input.tail && fill_input() <= 0;
+}
+
+
+/***********************************************************************
+ * time_command()
+ *
+ * DESCRIPTION
+ *   time command [| command ...]
+ *
+ *   Run the rest of @vector and report the wall clock time it took. For a
+ *   pipeline, also report the wall clock time of each stage, from its
+ *   launch until it was reaped, and what wait4() says it cost: user and
+ *   system CPU time, maximum RSS, voluntary and involuntary context
+ *   switches, and minor and major page faults. A background command is
+ *   run without being timed.
+ */
+static double timeval_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int time_command(struct tokens *vector)
+{
+	struct pipeline *pipeline = &__pipeline;
+	struct timespec start, end;
+	int ret;
+
+	memmove(vector->tokens, vector->tokens + 1, sizeof(char *) * vector->nr_tokens);
+	memmove(vector->quoted, vector->quoted + 1, sizeof(*vector->quoted) * (vector->nr_tokens - 1));
+	if (--vector->nr_tokens == 0) return 1;
+
+	if (is_operator(vector, vector->nr_tokens - 1, "&")) return run_command(vector);
+
+	/* There would be nothing left to report the times */
+	__last_command = false;
+	pipeline->nr_started = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = run_command(vector);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (pipeline->nr_started) {
+		fprintf(stderr, "%-16s %9s %9s %9s %10s %6s %6s %8s %6s\n", "command", "real",
+				"user", "sys", "maxrss", "vcsw", "ivcsw", "minflt", "majflt");
+	}
+	for (int i = 0; i < pipeline->nr_started; i++) {
+		struct stage *stage = pipeline->stages + i;
+		struct rusage *ru = &stage->rusage;
+
+		if (stage->pid < 0) continue;
+		fprintf(stderr, "%-16s %8.3fs %8.3fs %8.3fs %8ldKB %6ld %6ld %8ld %6ld\n",
+				stage->argv[0], (stage->end - stage->start) / 1e9,
+				timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+				ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw,
+				ru->ru_minflt, ru->ru_majflt);
+	}
+	fprintf(stderr, "real %.3fs\n", (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9);
+
+	return ret;
+}
+
 
 /***********************************************************************
  * run_command()
  *
  * DESCRIPTION
- *   Implement the specified shell features here using the parsed
- *   command tokens.
+ *   Implement the specified shell features here using the parsed
+ *   command tokens.
+ *
+ * RETURN VALUE
+ *   Return 1 on successful command execution
+ *   Return 0 when user inputs "exit"
+ *   Return <0 on error
+ */
+static int run_command(struct tokens *vector)
+{
+	struct pipeline *pipeline = &__pipeline;
+	int nr_tokens = vector->nr_tokens;
+	char **tokens = vector->tokens;
+	bool background = false;
+	int ret;
+
+	if (is_operator(vector, 0, "time")) return time_command(vector);
+	if (is_operator(vector, 0, "exec")) return exec_command(vector);
+
+	if (is_operator(vector, nr_tokens - 1, "&")) {
+		if (nr_tokens == 1) {
+			fprintf(stderr, "Syntax error near &\n");
+			return -EINVAL;
+		}
+		tokens[--vector->nr_tokens] = NULL;
+		nr_tokens--;
+		background = true;
+	}
+
+	if (strcmp(tokens[0], "exit") == 0) return 0;
+
+	if (is_built_in(tokens[0]) && discard_here_documents(vector) > 0) {
+		fprintf(stderr, "Here-documents do not apply to %s\n", tokens[0]);
+		return -EINVAL;
+	}
+
+	if (built_in_command(nr_tokens, tokens) == 1) {
+		__stats.nr_builtins++;
+		return 1;
+	}
+
+	if ((ret = build_pipeline(pipeline, vector)) < 0) {
+		if (ret == -EINVAL) fprintf(stderr, "Syntax error near %s\n", __syntax_error);
+		goto out;
+	}
+
+	/* The shell can copy for only one of them, and only in the foreground */
+	if (pipeline->stages[0].redir.splice &&
+			(background || pipeline->fan_out < pipeline->nr_stages)) {
+		fprintf(stderr, "<| cannot run in the background or with a fan-out\n");
+		ret = -EINVAL;
+	} else if (background && pipeline->fan_out < pipeline->nr_stages) {
+		fprintf(stderr, "Fan-out cannot run in the background\n");
+		ret = -EINVAL;
+	} else if (background) {
+		ret = run_background(pipeline);
+	} else if (__last_command && pipeline->nr_stages == 1 && !pipeline->stages[0].redir.splice) {
+		ret = exec_stage(pipeline->stages);
+	} else {
+		ret = run_pipeline(pipeline);
+	}
+out:
+	close_heres(pipeline);
+	return ret;
+}
+
+
+/***********************************************************************
+ * struct list_head history
+ *
+ * DESCRIPTION
+ *   Use this list_head to store unlimited command history.
+ */
+LIST_HEAD(history);
+struct entry{
+	struct list_head list;
+	char string[];
+};
+
+/***********************************************************************
+ * History arena
+ *
+ * DESCRIPTION
+ *   History entries are never freed one by one, so they are carved out
+ *   of large chunks with a bump pointer instead of two malloc() calls
+ *   each. finalize() returns the whole arena at once.
+ */
+#define HISTORY_ARENA_CHUNK	(1 << 20)
+
+struct arena_chunk {
+	struct list_head list;
+	size_t used;
+	size_t size;
+	char data[] __attribute__((aligned(sizeof(void *))));
+};
+
+LIST_HEAD(__history_arena);
+static size_t __history_bytes = 0;		/* Bytes taken from the arena */
+static size_t __history_malloc_bytes = 0;	/* What two malloc()s would take */
+
+static void *arena_alloc(size_t size)
+{
+	struct arena_chunk *chunk = list_first_entry_or_null(&__history_arena, struct arena_chunk, list);
+	void *p;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!chunk || chunk->used + size > chunk->size) {
+		size_t len = size > HISTORY_ARENA_CHUNK ? size : HISTORY_ARENA_CHUNK;
+
+		if (!(chunk = malloc(sizeof(*chunk) + len))) return NULL;
+		chunk->used = 0;
+		chunk->size = len;
+		list_add(&chunk->list, &__history_arena);
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return p;
+}
+
+static void free_arena(void)
+{
+	struct arena_chunk *chunk, *n;
+
+	list_for_each_entry_safe(chunk, n, &__history_arena, list) {
+		list_del(&chunk->list);
+		free(chunk);
+	}
+}
+
+/* glibc chunk size for malloc(@size): 8-byte header, 16-byte aligned */
+static size_t malloc_footprint(size_t size)
+{
+	size = (size + sizeof(size_t) + 15) & ~(size_t)15;
+
+	return size < 32 ? 32 : size;
+}
+
+
+/***********************************************************************
+ * History index
+ *
+ * DESCRIPTION
+ *   Entry pointers in append order, kept in fixed-size chunks next to
+ *   the history list so that "! N" is two array lookups. Only the chunk
+ *   directory is ever reallocated, so entries never move.
+ */
+#define HISTORY_CHUNK_SHIFT	10
+#define HISTORY_CHUNK_SIZE	(1U << HISTORY_CHUNK_SHIFT)
+
+static struct entry ***__history_index = NULL;
+static unsigned int __nr_history_chunks = 0;
+static unsigned int __nr_history = 0;
+static unsigned int __history_ceiling = UINT_MAX;
+
+static int index_history(struct entry *item)
+{
+	unsigned int chunk = __nr_history >> HISTORY_CHUNK_SHIFT;
+
+	if (chunk == __nr_history_chunks) {
+		unsigned int nr_chunks = __nr_history_chunks ? __nr_history_chunks * 2 : 16;
+		struct entry ***index = realloc(__history_index, sizeof(*index) * nr_chunks);
+
+		if (!index) return -ENOMEM;
+		memset(index + __nr_history_chunks, 0,
+				sizeof(*index) * (nr_chunks - __nr_history_chunks));
+		__history_index = index;
+		__nr_history_chunks = nr_chunks;
+	}
+	if (!__history_index[chunk]) {
+		__history_index[chunk] = arena_alloc(sizeof(struct entry *) * HISTORY_CHUNK_SIZE);
+		if (!__history_index[chunk]) return -ENOMEM;
+	}
+
+	__history_index[chunk][__nr_history & (HISTORY_CHUNK_SIZE - 1)] = item;
+	__nr_history++;
+
+	return 0;
+}
+
+static struct entry *get_history(unsigned int nr)
+{
+	if (nr >= __nr_history) return NULL;
+
+	return __history_index[nr >> HISTORY_CHUNK_SHIFT][nr & (HISTORY_CHUNK_SIZE - 1)];
+}
+
+
+/***********************************************************************
+ * History file
+ *
+ * DESCRIPTION
+ *   With "-H <file>", the history is also kept in an append-only log:
+ *
+ *     file   := "POSHHIS1" (record | index)*
+ *     record := u32 len, command '\0'            (len includes the '\0')
+ *     index  := u32 INDEX_TAG, u32 nr, u64 offset[nr], footer
+ *     footer := u64 prev, u64 nr, u64 INDEX_MAGIC
+ *
+ *   Each command goes to the file with a single writev(), so a crash may
+ *   tear the last record only. finalize() appends an index of the records
+ *   of the session whose footer points to the end of the previous index.
+ *   Startup mmap()s the file and only follows the footers; entries of
+ *   earlier sessions are read out of the mapping when they are asked for.
+ *   A file not ending with a footer (e.g., after a crash) is scanned once
+ *   and indexed as a whole at exit.
+ *
+ *   Several shells may share a file. Each takes the offset of its records
+ *   from where its O_APPEND writes actually landed. If any other shell
+ *   wrote since this one opened the file, its own index would leave their
+ *   records out and chain to a stale footer. So under flock() at exit, the
+ *   file is scanned again and indexed as a whole instead.
+ */
+#define HISTORY_FILE_MAGIC	"POSHHIS1"
+#define HISTORY_FILE_HDR	(sizeof(HISTORY_FILE_MAGIC) - 1)
+#define HISTORY_INDEX_TAG	0xffffffffU
+#define HISTORY_INDEX_MAGIC	0x5844494853534f50ULL	/* "POSSHIDX" */
+
+struct history_footer {
+	uint64_t prev;
+	uint64_t nr;
+	uint64_t magic;
+};
+
+struct history_segment {
+	unsigned long base;	/* History number of the first record */
+	unsigned long nr;
+	const char *offsets;	/* u64 offset[nr] in the mapping, unaligned */
+};
+
+static const char *__history_file = NULL;
+static int __history_fd = -1;
+static char *__history_map = NULL;
+static size_t __history_map_size = 0;
+
+static struct history_segment *__history_segments = NULL;
+static unsigned int __nr_history_segments = 0;
+static unsigned long __nr_indexed_history = 0;	/* Covered by the segments */
+static unsigned long __nr_file_history = 0;	/* Entries of earlier sessions */
+
+/* Records not covered by any index yet; written out as an index at exit */
+static uint64_t *__history_offsets = NULL;
+static unsigned long __nr_history_offsets = 0;
+static unsigned long __history_offsets_size = 0;
+
+static uint64_t __history_file_end = 0;	/* Where our last record ended */
+static uint64_t __history_prev_index = 0;
+static bool __history_interleaved = false;	/* Others wrote since we opened */
+
+static uint64_t load_u64(const char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t load_u32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int push_history_offset(uint64_t offset)
+{
+	if (__nr_history_offsets == __history_offsets_size) {
+		unsigned long size = __history_offsets_size ? __history_offsets_size * 2 : 1024;
+		uint64_t *offsets = realloc(__history_offsets, sizeof(*offsets) * size);
+
+		if (!offsets) return -ENOMEM;
+		__history_offsets = offsets;
+		__history_offsets_size = size;
+	}
+	__history_offsets[__nr_history_offsets++] = offset;
+
+	return 0;
+}
+
+/***********************************************************************
+ * load_history_index()
+ *
+ * DESCRIPTION
+ *   Follow the chain of footers from the end of the mapping, and set up
+ *   one segment per index found.
+ *
+ * RETURN VALUE
+ *   Return 0 if the whole file is covered by the indexes
+ *   Return -EINVAL otherwise
+ */
+static int load_history_index(void)
+{
+	uint64_t end = __history_map_size;
+	unsigned int nr_segments = 0;
+	unsigned long base = 0;
+
+	while (end > HISTORY_FILE_HDR) {
+		struct history_footer footer;
+		struct history_segment *segments;
+		uint64_t index;
+
+		if (end < HISTORY_FILE_HDR + 8 + sizeof(footer)) return -EINVAL;
+		memcpy(&footer, __history_map + end - sizeof(footer), sizeof(footer));
+		if (footer.magic != HISTORY_INDEX_MAGIC) return -EINVAL;
+		if (footer.nr > (end - HISTORY_FILE_HDR - 8 - sizeof(footer)) / 8) return -EINVAL;
+
+		index = end - sizeof(footer) - footer.nr * 8 - 8;
+		if (load_u32(__history_map + index) != HISTORY_INDEX_TAG ||
+				load_u32(__history_map + index + 4) != (uint32_t)footer.nr ||
+				footer.prev > index)
+			return -EINVAL;
+
+		if (!(nr_segments & (nr_segments - 1))) {
+			segments = realloc(__history_segments,
+					sizeof(*segments) * (nr_segments ? nr_segments * 2 : 1));
+			if (!segments) return -ENOMEM;
+			__history_segments = segments;
+		}
+		__history_segments[nr_segments].nr = footer.nr;
+		__history_segments[nr_segments].offsets = __history_map + index + 8;
+		nr_segments++;
+
+		end = footer.prev;
+	}
+
+	/* The chain is found newest first */
+	for (unsigned int i = 0; i < nr_segments / 2; i++) {
+		struct history_segment tmp = __history_segments[i];
+
+		__history_segments[i] = __history_segments[nr_segments - 1 - i];
+		__history_segments[nr_segments - 1 - i] = tmp;
+	}
+	for (unsigned int i = 0; i < nr_segments; i++) {
+		__history_segments[i].base = base;
+		base += __history_segments[i].nr;
+	}
+
+	__nr_history_segments = nr_segments;
+	__nr_indexed_history = base;
+	__history_prev_index = __history_map_size > HISTORY_FILE_HDR ? __history_map_size : 0;
+
+	return 0;
+}
+
+/***********************************************************************
+ * scan_history_file()
+ *
+ * DESCRIPTION
+ *   Walk every record of the mapping to rebuild the offsets, and cut off
+ *   a record torn by a crash if @repair. At exit, the last record may be
+ *   one another shell is still writing, so it is only left out then.
+ */
+static void scan_history_file(bool repair)
+{
+	uint64_t pos = HISTORY_FILE_HDR;
+
+	free(__history_segments);
+	__history_segments = NULL;
+	__nr_history_segments = 0;
+	__nr_indexed_history = 0;
+	__history_prev_index = 0;
+
+	while (pos + 4 <= __history_map_size) {
+		uint32_t len = load_u32(__history_map + pos);
+
+		if (len == HISTORY_INDEX_TAG) {
+			uint64_t nr;
+
+			if (pos + 8 > __history_map_size) break;
+			nr = load_u32(__history_map + pos + 4);
+			if (pos + 8 + nr * 8 + sizeof(struct history_footer) > __history_map_size)
+				break;
+			pos += 8 + nr * 8 + sizeof(struct history_footer);
+			continue;
+		}
+		if (len == 0 || pos + 4 + len > __history_map_size ||
+				__history_map[pos + 4 + len - 1] != '\0')
+			break;
+		if (push_history_offset(pos)) break;
+
+		pos += 4 + len;
+	}
+
+	if (repair && pos != __history_map_size) {
+		fprintf(stderr, "Truncating history file at %llu\n", (unsigned long long)pos);
+		if (ftruncate(__history_fd, pos) == 0) __history_map_size = pos;
+	}
+}
+
+static int open_history_file(const char *path)
+{
+	struct stat st;
+
+	__history_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (__history_fd < 0 || fstat(__history_fd, &st) < 0) goto out_err;
+
+	if (st.st_size == 0) {
+		if (write(__history_fd, HISTORY_FILE_MAGIC, HISTORY_FILE_HDR) != HISTORY_FILE_HDR)
+			goto out_err;
+		st.st_size = HISTORY_FILE_HDR;
+	}
+
+	__history_map_size = st.st_size;
+	__history_map = mmap(NULL, __history_map_size, PROT_READ, MAP_SHARED, __history_fd, 0);
+	if (__history_map == MAP_FAILED) {
+		__history_map = NULL;
+		goto out_err;
+	}
+	if (__history_map_size < HISTORY_FILE_HDR ||
+			memcmp(__history_map, HISTORY_FILE_MAGIC, HISTORY_FILE_HDR) != 0) {
+		fprintf(stderr, "%s is not a history file\n", path);
+		return -EINVAL;
+	}
+
+	if (load_history_index()) scan_history_file(true);
+
+	__nr_file_history = __nr_indexed_history + __nr_history_offsets;
+	__history_file_end = __history_map_size;
+
+	return 0;
+
+out_err:
+	fprintf(stderr, "Unable to open history file %s\n", path);
+	return -errno;
+}
+
+/* Map the file anew as it is now and take all of its records */
+static int rescan_history_file(size_t size)
+{
+	char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, __history_fd, 0);
+
+	if (map == MAP_FAILED) return -errno;
+	if (__history_map) munmap(__history_map, __history_map_size);
+	__history_map = map;
+	__history_map_size = size;
+
+	__nr_history_offsets = 0;
+	scan_history_file(false);
+
+	return 0;
+}
+
+static void close_history_file(void)
+{
+	struct history_footer footer = {
+		.magic = HISTORY_INDEX_MAGIC,
+	};
+	uint32_t header[2] = { HISTORY_INDEX_TAG };
+	struct iovec iov[] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = NULL },
+		{ .iov_base = &footer, .iov_len = sizeof(footer) },
+	};
+	struct stat st;
+
+	if (__history_fd < 0) return;
+
+	if (__nr_history_offsets) {
+		flock(__history_fd, LOCK_EX);
+
+		if (fstat(__history_fd, &st) < 0 ||
+				((__history_interleaved || (uint64_t)st.st_size != __history_file_end) &&
+				 rescan_history_file(st.st_size))) {
+			fprintf(stderr, "Unable to write history index\n");
+			goto out;
+		}
+
+		footer.prev = __history_prev_index;
+		footer.nr = header[1] = __nr_history_offsets;
+		iov[1].iov_base = __history_offsets;
+		iov[1].iov_len = sizeof(uint64_t) * __nr_history_offsets;
+		if (writev(__history_fd, iov, 3) < 0)
+			fprintf(stderr, "Unable to write history index\n");
+	}
+out:
+	if (__history_map) munmap(__history_map, __history_map_size);
+	close(__history_fd);
+	free(__history_segments);
+	free(__history_offsets);
+}
+
+/***********************************************************************
+ * write_history_file()
+ *
+ * DESCRIPTION
+ *   Append @len bytes of @command including the '\0' as a record.
+ */
+static void write_history_file(const char *command, size_t len)
+{
+	uint32_t len32 = len;
+	struct iovec iov[] = {
+		{ .iov_base = &len32, .iov_len = sizeof(len32) },
+		{ .iov_base = (void *)command, .iov_len = len },
+	};
+	off_t end;
+
+	if (__history_fd < 0) return;
+
+	if (writev(__history_fd, iov, 2) != (ssize_t)(sizeof(len32) + len)) return;
+
+	/* O_APPEND put it at the end, which need not be where we left off */
+	if ((end = lseek(__history_fd, 0, SEEK_CUR)) < 0) return;
+	if ((uint64_t)end - sizeof(len32) - len != __history_file_end) __history_interleaved = true;
+	__history_file_end = end;
+
+	push_history_offset(end - sizeof(len32) - len);
+}
+
+/***********************************************************************
+ * get_file_history()
+ *
+ * DESCRIPTION
+ *   Read the @nr-th entry of the earlier sessions out of the mapping.
+ *
+ * RETURN VALUE
+ *   Return the command string
+ *   Return NULL if the record is out of the mapping or malformed
+ */
+static const char *get_file_history(unsigned long nr)
+{
+	uint64_t offset;
+	uint32_t len;
+
+	if (nr < __nr_indexed_history) {
+		unsigned int lo = 0, hi = __nr_history_segments;
+
+		while (hi - lo > 1) {
+			unsigned int mid = (lo + hi) / 2;
+
+			if (__history_segments[mid].base <= nr) lo = mid;
+			else hi = mid;
+		}
+		offset = load_u64(__history_segments[lo].offsets +
+				(nr - __history_segments[lo].base) * 8);
+	} else {
+		offset = __history_offsets[nr - __nr_indexed_history];
+	}
+
+	if (offset > __history_map_size - 4) return NULL;
+	len = load_u32(__history_map + offset);
+	if (len == 0 || len > __history_map_size - offset - 4 ||
+			__history_map[offset + 4 + len - 1] != '\0')
+		return NULL;
+
+	return __history_map + offset + 4;
+}
+
+/***********************************************************************
+ * history_string()
+ *
+ * DESCRIPTION
+ *   Look up the @nr-th command across the earlier sessions and this one.
+ */
+static const char *history_string(unsigned long nr)
+{
+	if (nr < __nr_file_history) return get_file_history(nr);
+
+	nr -= __nr_file_history;
+	if (nr >= __nr_history) return NULL;
+
+	return get_history(nr)->string;
+}
+
+static unsigned long nr_history(void)
+{
+	return __nr_file_history + __nr_history;
+}
+
+
+/***********************************************************************
+ * Shared history
+ *
+ * DESCRIPTION
+ *   With "-S <file>", commands are also published into a ring of slots
+ *   in a file mmap()ed by every posh on the host. Writers reserve a
+ *   sequence number with an atomic increment of @head and never lock.
+ *   A slot's @state is seq * 2 + 1 while being written and seq * 2 + 2
+ *   once published, so readers copy the text and check that @state did
+ *   not move in between. Peers' commands are listed by "history -g" and
+ *   recalled with "! @<seq>".
+ */
+#define SHARED_HISTORY_MAGIC	0x5453494848534f50ULL	/* "POSHHIST" */
+#define NR_SHARED_SLOTS		1024
+#define SHARED_SLOT_SIZE	4096
+
+struct shared_slot {
+	uint64_t state;
+	pid_t pid;
+	uint32_t len;
+	char string[SHARED_SLOT_SIZE - 16];
+};
+
+struct shared_history {
+	uint64_t magic;
+	uint64_t head;		/* Next sequence number to hand out */
+	char pad[SHARED_SLOT_SIZE - 16];
+	struct shared_slot slots[NR_SHARED_SLOTS];
+};
+
+static const char *__shared_history_file = NULL;
+static struct shared_history *__shared_history = NULL;
+static uint64_t __shared_ceiling = UINT64_MAX;
+
+static int open_shared_history(const char *path)
+{
+	struct stat st;
+	uint64_t magic = 0;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || fstat(fd, &st) < 0) goto out_err;
+
+	/* A zero-filled file is an empty ring, so racing creators are fine */
+	if (st.st_size < (off_t)sizeof(struct shared_history) &&
+			ftruncate(fd, sizeof(struct shared_history)) < 0)
+		goto out_err;
+
+	__shared_history = mmap(NULL, sizeof(struct shared_history),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (__shared_history == MAP_FAILED) {
+		__shared_history = NULL;
+		goto out_err;
+	}
+	close(fd);
+
+	__atomic_compare_exchange_n(&__shared_history->magic, &magic, SHARED_HISTORY_MAGIC,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&__shared_history->magic, __ATOMIC_ACQUIRE) != SHARED_HISTORY_MAGIC) {
+		fprintf(stderr, "%s is not a shared history file\n", path);
+		munmap(__shared_history, sizeof(struct shared_history));
+		__shared_history = NULL;
+		return -EINVAL;
+	}
+	return 0;
+
+out_err:
+	fprintf(stderr, "Unable to open shared history %s\n", path);
+	if (fd >= 0) close(fd);
+	return -errno;
+}
+
+static void close_shared_history(void)
+{
+	if (!__shared_history) return;
+
+	munmap(__shared_history, sizeof(struct shared_history));
+	__shared_history = NULL;
+}
+
+/***********************************************************************
+ * publish_shared_history()
+ *
+ * DESCRIPTION
+ *   Publish @len bytes of @command including the '\0' into the ring.
  *
  * RETURN VALUE
- *   Return 1 on successful command execution
- *   Return 0 when user inputs "exit"
- *   Return <0 on error
+ *   Return the sequence number reserved for @command
  */
-static int run_command(int nr_tokens, char *tokens[])
+static uint64_t publish_shared_history(const char *command, size_t len)
 {
-	int pipe_point=-1, is_pipe=0,i;
-	int status1,status2;		
-	
-	pid_t pid1,pid2;
-	
-	char **cmd1,**cmd2;
-	int fd[2];
-	
-	if (strcmp(tokens[0], "exit") == 0) return 0;
-	
-	if (nr_tokens>1)
-	{
-		for(int i=0;i<nr_tokens;i++)
-		{
-			if(strcmp(tokens[i],"|")==0)
-			{
-				pipe_point=i;
-				is_pipe=1;
-				break;
-			}
-		}
-		
+	struct shared_slot *slot;
+	uint64_t seq, state;
+
+	seq = __atomic_fetch_add(&__shared_history->head, 1, __ATOMIC_ACQ_REL);
+	slot = __shared_history->slots + seq % NR_SHARED_SLOTS;
+
+	/* Claim the slot unless a writer from a later lap already did */
+	state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+	do {
+		if (state >= seq * 2 + 1) return seq;
+	} while (!__atomic_compare_exchange_n(&slot->state, &state, seq * 2 + 1,
+				true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if (len > sizeof(slot->string)) len = sizeof(slot->string);
+	slot->pid = getpid();
+	slot->len = len;
+	memcpy(slot->string, command, len);
+	slot->string[len - 1] = '\0';
+
+	state = seq * 2 + 1;
+	__atomic_compare_exchange_n(&slot->state, &state, seq * 2 + 2,
+			false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+	return seq;
+}
+
+/***********************************************************************
+ * read_shared_history()
+ *
+ * DESCRIPTION
+ *   Copy the command published as @seq into @buffer.
+ *
+ * RETURN VALUE
+ *   Return the pid of the publisher
+ *   Return -ENOENT if @seq is overwritten or not published yet
+ */
+static pid_t read_shared_history(uint64_t seq, char *buffer, size_t size)
+{
+	struct shared_slot *slot = __shared_history->slots + seq % NR_SHARED_SLOTS;
+	uint32_t len;
+	pid_t pid;
+
+	if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != seq * 2 + 2) return -ENOENT;
+
+	pid = slot->pid;
+	len = slot->len;
+	if (len > size) len = size;
+	if (len > sizeof(slot->string)) len = sizeof(slot->string);
+	memcpy(buffer, slot->string, len);
+	if (len) buffer[len - 1] = '\0';
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) != seq * 2 + 2 || !len)
+		return -ENOENT;
+
+	return pid;
+}
+
+static void list_shared_history(void)
+{
+	char command[SHARED_SLOT_SIZE];
+	uint64_t head, seq;
+
+	if (!__shared_history) return;
+
+	head = __atomic_load_n(&__shared_history->head, __ATOMIC_ACQUIRE);
+	seq = head > NR_SHARED_SLOTS ? head - NR_SHARED_SLOTS : 0;
+
+	for (; seq < head; seq++) {
+		pid_t pid = read_shared_history(seq, command, sizeof(command));
+
+		if (pid < 0) continue;
+		fprintf(stderr, "@%llu [%d]: %s", (unsigned long long)seq, pid, command);
 	}
-	
-	if(is_pipe!=0)
-	{
-		cmd1 = (char **)malloc(sizeof(char*)*(pipe_point+1));
-	 	for(i=0;i<pipe_point;i++) 
-	 	{
-	 		cmd1[i]=(char *)malloc(strlen(tokens[i])+1);	
-	 		strcpy(cmd1[i],tokens[i]);
-	 		//fprintf(stderr,"cmd1[%d] :%s\n",i,cmd1[i]);
-	 	}
-	 	strcat(cmd1[pipe_point],"\0");
-	 	cmd2 = (char **)malloc(sizeof(char*)*(nr_tokens-pipe_point-1));
-	 	for(i=pipe_point+1;i<nr_tokens;i++)
-	 	{
-	 		cmd2[i-(pipe_point+1)]=(char *) malloc(strlen(tokens[i])+1);
-	 	 	strcpy(cmd2[i-(pipe_point+1)],tokens[i]);
-	 	 	//fprintf(stderr,"cmd2[%d] :%s\n",i-(pipe_point+1),cmd2[i-(pipe_point+1)]);
-	 	}
-	 	
-	 	if(pipe(fd)<0)	return -1;
-	 	
+}
+
+
+/***********************************************************************
+ * History search index
+ *
+ * DESCRIPTION
+ *   Posting lists of history numbers keyed by the trigrams of each entry.
+ *   The first one or two characters are also indexed with an anchor so
+ *   that prefixes can be looked up. A query walks the shortest posting
+ *   list among its trigrams and verifies each candidate, so its cost
+ *   follows the number of matches rather than the size of the history.
+ *   Entries are indexed as they are appended; entries loaded from the
+ *   history file are indexed on the first search.
+ */
+#define NR_SEARCH_BUCKETS	(1 << 16)
+#define SEARCH_ANCHOR		'\001'
+
+struct posting {
+	unsigned int nr;
+	unsigned int size;
+	unsigned int *entries;
+};
+
+static struct posting __search_index[NR_SEARCH_BUCKETS];
+static unsigned long __nr_searchable = 0;	/* Entries [0, n) are indexed */
+
+static unsigned int hash_trigram(const char *s)
+{
+	unsigned int hash = (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2];
+
+	return (hash * 2654435761U) >> 16 & (NR_SEARCH_BUCKETS - 1);
+}
+
+static void add_posting(const char *trigram, unsigned int nr)
+{
+	struct posting *p = __search_index + hash_trigram(trigram);
+
+	/* Entries come in order, so a repeated trigram hits the tail */
+	if (p->nr && p->entries[p->nr - 1] == nr) return;
+
+	if (p->nr == p->size) {
+		unsigned int size = p->size ? p->size * 2 : 4;
+		unsigned int *entries = realloc(p->entries, sizeof(*entries) * size);
+
+		if (!entries) return;
+		p->entries = entries;
+		p->size = size;
 	}
-	
-	if(built_in_command(nr_tokens,tokens)==1) return 1;
-	else if(is_pipe==0)
-	{
-		//fprintf(stderr,"this is basic command area\n");
-		pid1=fork();
-		if(pid1==0)
-		{
-			if (execvp(tokens[0],tokens)<0) exit(-1);
-			exit(0);
-		}
-		waitpid(pid1, &status1, 0);
-		if (WEXITSTATUS(status1)==0) return 1;
+	p->entries[p->nr++] = nr;
+}
+
+static void index_search(const char *string, unsigned int nr)
+{
+	size_t len = strcspn(string, "\n");
+	char anchor[3] = { SEARCH_ANCHOR, string[0], SEARCH_ANCHOR };
+
+	if (len == 0) return;
+
+	add_posting(anchor, nr);
+	if (len >= 2) {
+		anchor[2] = string[1];
+		add_posting(anchor, nr);
 	}
-	else
-	{
-		//fprintf(stderr,"this is pipe area\n");
-		pid1=fork();
-		if(pid1<0) exit(-1);
-		else if(pid1==0)	//child
-		{
-			//for(i=0;i<pipe_point;i++) fprintf(stderr,"cmd1[%d] :%s\n",i,cmd1[i]);
-			//fprintf(stderr,"this is pipe child process area\n");
-			close(fd[0]);
-			dup2(fd[1],STDOUT_FILENO);
-			close(fd[1]);
-			if (execvp(cmd1[0],cmd1)<0) 
-			{
-				fprintf(stderr, "Unable to execute %s\n", cmd1[0]);
-				exit(-1);
-			}
-			exit(0);
-		}
-		else	//parent
-		{
-			pid2=fork();
-			if(pid2<0) exit(-1);
-			else if(pid2==0)	//child
-			{
-				//for(i=nr_tokens-pipe_point+1;i<nr_tokens;i++) fprintf(stderr,"cmd2[%d] :%s\n",i-(pipe_point+1),cmd2[i-(pipe_point+1)]);
-				//fprintf(stderr,"this is pipe parent-child process area\n");
-				close(fd[1]);
-				dup2(fd[0],STDIN_FILENO);
-				close(fd[0]);
-				if (execvp(cmd2[0],cmd2)<0)
-				{
-					fprintf(stderr, "Unable to execute %s\n", cmd2[0]);
-					exit(-1);
-				}
-				exit(0);
-			}
-			close(fd[1]);
-			waitpid(pid2, &status2, 0);
-			//fprintf(stderr,"status2 :%d\n",WEXITSTATUS(status2));
-			
-		}
-		waitpid(pid1, &status1, 0);
-		for(i=0;i<pipe_point;i++) free(cmd1[i]);
-	 	for(i=pipe_point+1;i<nr_tokens;i++) free(cmd2[i-(pipe_point+1)]);
-	 	//fprintf(stderr,"this is pipe parent process area\n");
-	 	//fprintf(stderr,"status1 : %d status2 :%d\n",WEXITSTATUS(status1),WEXITSTATUS(status2));
-	 	if(WEXITSTATUS(status1)==0 && WEXITSTATUS(status2)==0) return 1;
-	 	else return -EINVAL;
-	 	
-		
+	for (size_t i = 0; i + 3 <= len; i++)
+		add_posting(string + i, nr);
+}
+
+static void update_search_index(void)
+{
+	for (; __nr_searchable < nr_history(); __nr_searchable++) {
+		const char *string = history_string(__nr_searchable);
+
+		if (string) index_search(string, __nr_searchable);
 	}
-	
-	//while(wait(NULL)!=-1);
-	
-	fprintf(stderr, "Unable to execute %s\n", tokens[0]);
-	return -EINVAL;
 }
 
+static void free_search_index(void)
+{
+	for (int i = 0; i < NR_SEARCH_BUCKETS; i++)
+		free(__search_index[i].entries);
+}
 
 /***********************************************************************
- * struct list_head history
+ * search_candidates()
  *
  * DESCRIPTION
- *   Use this list_head to store unlimited command history.
+ *   Pick the posting list to walk for @pattern, which is a substring
+ *   or, when @prefix is true, a prefix of the entries looked for.
+ *
+ * RETURN VALUE
+ *   Return the shortest posting list among the trigrams of @pattern
+ *   Return NULL if @pattern is too short to use the index
  */
-LIST_HEAD(history);
-struct entry{
-	struct list_head list;
-	char *string;
-};
+static struct posting *search_candidates(const char *pattern, bool prefix)
+{
+	size_t len = strlen(pattern);
+	struct posting *best = NULL;
+
+	update_search_index();
+
+	if (prefix && len) {
+		char anchor[3] = { SEARCH_ANCHOR, pattern[0], len >= 2 ? pattern[1] : SEARCH_ANCHOR };
+
+		best = __search_index + hash_trigram(anchor);
+	}
+	for (size_t i = 0; i + 3 <= len; i++) {
+		struct posting *p = __search_index + hash_trigram(pattern + i);
+
+		if (!best || p->nr < best->nr) best = p;
+	}
+	return best;
+}
+
+static void search_history(const char *pattern)
+{
+	struct posting *p = search_candidates(pattern, false);
+	const char *string;
+
+	if (p) {
+		for (unsigned int i = 0; i < p->nr; i++) {
+			string = history_string(p->entries[i]);
+			if (string && strstr(string, pattern))
+				fprintf(stderr, "%2u: %s", p->entries[i], string);
+		}
+		return;
+	}
+
+	/* Shorter than a trigram; nothing to narrow down with */
+	for (unsigned long nr = 0; nr < nr_history(); nr++) {
+		string = history_string(nr);
+		if (string && strstr(string, pattern))
+			fprintf(stderr, "%2lu: %s", nr, string);
+	}
+}
+
+/***********************************************************************
+ * find_history_prefix()
+ *
+ * DESCRIPTION
+ *   Find the latest entry before @limit that starts with @prefix.
+ *
+ * RETURN VALUE
+ *   Return the history number of the entry
+ *   Return -ENOENT if none, or if @prefix is empty
+ */
+static long find_history_prefix(const char *prefix, unsigned long limit)
+{
+	struct posting *p;
+	size_t len = strlen(prefix);
+
+	/* "! ''" names no entry rather than every one */
+	if (!len || !(p = search_candidates(prefix, true))) return -ENOENT;
+
+	for (unsigned int i = p->nr; i > 0; i--) {
+		unsigned int nr = p->entries[i - 1];
+		const char *string;
+
+		if (nr >= limit) continue;
+		string = history_string(nr);
+		if (string && strncmp(string, prefix, len) == 0) return nr;
+	}
+	return -ENOENT;
+}
 
 
 /***********************************************************************
@@ -185,13 +3344,27 @@ struct entry{
  */
 static void append_history(char * const command)
 {
-	struct entry *item = malloc(sizeof(struct entry));
-	 INIT_LIST_HEAD(&item->list);
-	 
-	 item->string = (char *)malloc(strlen(command)+1);
-	 strcpy(item->string,command);
-	 
-	 list_add(&item->list,&history);
+	uint64_t start = now_ns();
+	size_t len = strlen(command) + 1;
+	struct entry *item = arena_alloc(sizeof(struct entry) + len);
+
+	if (!item) return;
+
+	INIT_LIST_HEAD(&item->list);
+	memcpy(item->string, command, len);
+
+	list_add(&item->list,&history);
+	index_history(item);
+	if (__nr_searchable == nr_history() - 1) update_search_index();
+	write_history_file(command, len);
+	/* The command being run may only recall what was published before */
+	if (__shared_history) __shared_ceiling = publish_shared_history(command, len);
+
+	__history_bytes += (sizeof(struct entry) + len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	__history_malloc_bytes += malloc_footprint(sizeof(struct list_head) + sizeof(char *))
+			+ malloc_footprint(len);
+
+	trace_span(TRACE_HISTORY, start, record_latency(&__stats.history, start), 0, NULL);
 }
 
 
@@ -208,6 +3381,11 @@ static void append_history(char * const command)
  */
 static int initialize(int argc, char * const argv[])
 {
+	if (__history_file && open_history_file(__history_file)) return -EINVAL;
+	if (__shared_history_file && open_shared_history(__shared_history_file)) return -EINVAL;
+	if (init_jobs()) return -EINVAL;
+	if (init_flight_recorder()) return -EINVAL;
+
 	return 0;
 }
 
@@ -221,35 +3399,115 @@ static int initialize(int argc, char * const argv[])
  */
 static void finalize(int argc, char * const argv[])
 {
+	flush_path_cache();
+	free(__path_cache_env);
 
+	free_spawn_actions();
+	free_jobs();
+	flush_trace();
+	close_history_file();
+	close_shared_history();
+	free_search_index();
+	free(__history_index);
+	free_arena();
 }
 
 /***********************************************************************
  ********************command_functions**********************************
  ***********************************************************************/
  
+/**
+ * Recalled commands are parsed in their own buffer and token vector. A
+ * recalled "!" is done with its tokens by the time it recalls further,
+ * so one of each serves every level of recall.
+ */
+static struct tokens __recall_tokens;
+static char *__recall_buffer = NULL;
+static size_t __recall_buffer_size = 0;
+
+static char *recall_buffer(size_t len)
+{
+	if (len > __recall_buffer_size) {
+		char *buffer = realloc(__recall_buffer, len);
+
+		if (!buffer) return NULL;
+		__recall_buffer = buffer;
+		__recall_buffer_size = len;
+	}
+	return __recall_buffer;
+}
+
 static int __process_cmd(char * command)
 {
- 	char *tokens[MAX_NR_TOKENS] = { NULL };
-	int nr_tokens = 0;
+	uint64_t start = now_ns();
+	int ret = parse_command(command, &__recall_tokens);
 
-	if (parse_command(command, &nr_tokens, tokens) == 0)
-		return 1;
+	trace_span(TRACE_PARSE, start, record_latency(&__stats.parse, start), 0, NULL);
+	if (ret == -EINVAL) fprintf(stderr, "Unterminated quote\n");
+	if (ret <= 0) return 1;
+
+	return run_command(&__recall_tokens);
+}
+
+/**
+ * Glue @tokens back into one string, a space apart, in the buffer they
+ * were parsed in. Quotes may have left bytes between the tokens, so each
+ * one is moved down to follow the previous one.
+ */
+static char *join_tokens(char *tokens[])
+{
+	char *end = tokens[0] + strlen(tokens[0]);
 
-	return run_command(nr_tokens, tokens);
+	for (int i = 1; tokens[i]; i++) {
+		size_t len = strlen(tokens[i]);
+
+		*end++ = ' ';
+		memmove(end, tokens[i], len + 1);
+		end += len;
+	}
+	return tokens[0];
 }
 
 static int history_command(char* tokens[], int case_num)
 {
-	int num=0,i=0;
-	char* cmd;
-	int is_history=0;
+	char *command;
+	unsigned int num, limit, ceiling = __history_ceiling;
+	const char *string;
 	struct entry *temp;
-	
+	long found;
+	int i=0;
+
+	/**
+	 * The index of the "!" being run. A recalled "!" may only refer to
+	 * older entries, so chains of recalls always terminate.
+	 */
+	limit = ceiling < nr_history() - 1 ? ceiling : nr_history() - 1;
 	
 	switch(case_num)
 	{
 		case 0:
+			if (tokens[1] && strcmp(tokens[1], "-m") == 0) {
+				if (!__nr_history) return 1;
+				fprintf(stderr, "%u entries, %zu bytes/entry in arena, "
+						"%zu bytes/entry with malloc\n", __nr_history,
+						__history_bytes / __nr_history,
+						__history_malloc_bytes / __nr_history);
+				return 1;
+			}
+			if (tokens[1] && strcmp(tokens[1], "-g") == 0) {
+				list_shared_history();
+				return 1;
+			}
+			if (tokens[1] && strcmp(tokens[1], "-s") == 0) {
+				if (!tokens[2]) return -EINVAL;
+				search_history(join_tokens(tokens + 2));
+				return 1;
+			}
+			for (num = 0; num < __nr_file_history; num++) {
+				string = get_file_history(num);
+				fprintf(stderr, "%2u: %s", num, string ? string : "(corrupted)\n");
+			}
+			i = num;
 			list_for_each_entry_reverse(temp,&history,list)
 			{
 				fprintf(stderr,"%2d: %s",i,temp->string);
@@ -257,46 +3515,136 @@ static int history_command(char* tokens[], int case_num)
 			}
 			return 1;
 		case 1:
-			
-			if(strcmp(tokens[1],"!")==0)
-			{
-				list_for_each_entry(temp,&history,list)
-				{
-					if(strcmp(temp->string+1,"!")!=0)
-					{
-						cmd = (char *) malloc(sizeof(strlen(temp->string)+1));
-						strcpy(cmd,temp->string);
-						is_history=1;
-						break;
-					}
-				}
-			}
-			else
-			{
-				num = atoi(tokens[1]);
-				//fprintf(stderr,"num:%d\n",num);
-				list_for_each_entry_reverse(temp,&history,list)
-				{
-					cmd = (char *) malloc(sizeof(strlen(temp->string)+1));
-					strcpy(cmd,temp->string);
-					if (i==num){ is_history=1; break;}
-					i++;
-				}
+			if (!tokens[1]) break;
+
+			if (tokens[1][0] == '@' && __shared_history) {
+				uint64_t seq = strtoull(tokens[1] + 1, NULL, 10);
+				uint64_t shared_ceiling = __shared_ceiling;
+
+				/* Same as @limit, recalled "! @" may only go back */
+				if (seq >= shared_ceiling) break;
+				if (!(command = recall_buffer(SHARED_SLOT_SIZE))) break;
+				if (read_shared_history(seq, command, SHARED_SLOT_SIZE) < 0) break;
+
+				__shared_ceiling = seq;
+				__process_cmd(command);
+				__shared_ceiling = shared_ceiling;
+				return 1;
 			}
-			if (is_history==1) {__process_cmd(cmd); return 1;}
-			break;
+
+			if (limit == 0) break;
+
+			/* "! !" is the command right before this one */
+			if(strcmp(tokens[1],"!")==0) num = limit - 1;
+			else if (isdigit(tokens[1][0])) num = atoi(tokens[1]);
+			else if ((found = find_history_prefix(join_tokens(tokens + 1), limit)) >= 0)
+				num = found;
+			else break;
+
+			if (num >= limit) break;
+
+			if (!(string = history_string(num))) break;
+
+			/* parse_command() tokenizes in place, so work on a copy */
+			if (!(command = recall_buffer(strlen(string) + 1))) break;
+			strcpy(command, string);
+			__history_ceiling = num;
+			__process_cmd(command);
+			__history_ceiling = ceiling;
+			return 1;
 		default :
 			break;
 	}
 	return -EINVAL;
 }
 
+/***********************************************************************
+ * stats_command()
+ *
+ * DESCRIPTION
+ *   stats [--reset]
+ *
+ *   Print the performance counters, and latency percentiles in
+ *   microseconds out of each histogram. A percentile is the top of the
+ *   bucket it falls into, so it is at most 25% over. --reset clears the
+ *   counters and histograms.
+ */
+static double histogram_percentile(struct histogram *h, double p)
+{
+	uint64_t rank = h->count * p, seen = 0, value = h->max;
+
+	for (unsigned int i = 0; i < NR_HISTOGRAM_BUCKETS - 1; i++) {
+		if ((seen += h->buckets[i]) > rank) {
+			value = histogram_floor(i + 1) - 1;
+			break;
+		}
+	}
+	if (value > h->max) value = h->max;
+	if (value < h->min) value = h->min;
+
+	return value / 1e3;
+}
+
+static void print_histogram(const char *name, struct histogram *h)
+{
+	if (!h->count) {
+		fprintf(stderr, "%-8s %9d\n", name, 0);
+		return;
+	}
+	fprintf(stderr, "%-8s %9llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+			(unsigned long long)h->count, h->sum / 1e3 / h->count, h->min / 1e3,
+			histogram_percentile(h, 0.5), histogram_percentile(h, 0.9),
+			histogram_percentile(h, 0.99), h->max / 1e3);
+}
+
+static int stats_command(int nr_tokens, char *tokens[])
+{
+	if (nr_tokens > 1) {
+		if (strcmp(tokens[1], "--reset") != 0) {
+			fprintf(stderr, "Usage: stats [--reset]\n");
+			return 1;
+		}
+		memset(&__stats, 0, sizeof(__stats));
+		return 1;
+	}
+
+	fprintf(stderr, "commands %lu, built-ins %lu\n",
+			__stats.nr_commands, __stats.nr_builtins);
+	fprintf(stderr, "forks %lu, execs %lu, exec failures %lu\n",
+			__stats.nr_forks, __stats.nr_execs, __stats.nr_exec_failures);
+	fprintf(stderr, "history %lu entries, %zu bytes\n", nr_history(), __history_bytes);
+	fprintf(stderr, "allocations %lu, %lu while running commands\n",
+			nr_allocations(), __nr_dispatch_allocations);
+
+	fprintf(stderr, "%-8s %9s %9s %9s %9s %9s %9s %9s\n", "(us)",
+			"count", "mean", "min", "p50", "p90", "p99", "max");
+	print_histogram("parse", &__stats.parse);
+	print_histogram("command", &__stats.command);
+	print_histogram("launch", &__stats.launch);
+	print_histogram("wait", &__stats.wait);
+	print_histogram("history", &__stats.history);
+
+	return 1;
+}
+
 static int built_in_command(int nr_tokens, char *tokens[])
 {
 	char* path;
 	
 	if (strcmp(tokens[0],"history")==0 ) return history_command(tokens, 0);
 	else if(strcmp(tokens[0],"!")==0) return history_command(tokens,1);
+	else if(strcmp(tokens[0],"hash")==0) return hash_command(nr_tokens, tokens);
+	else if(strcmp(tokens[0],"jobs")==0 || strcmp(tokens[0],"wait")==0)
+		return jobs_command(nr_tokens, tokens);
+	else if(strcmp(tokens[0],"parallel")==0) return parallel_command(nr_tokens, tokens);
+	else if(strcmp(tokens[0],"stats")==0) return stats_command(nr_tokens, tokens);
+	else if(strcmp(tokens[0],"pipesize")==0) return pipesize_command(nr_tokens, tokens);
+	else if(strcmp(tokens[0],"allocs")==0)
+	{
+		fprintf(stderr, "%lu allocations, %lu while running commands\n",
+				nr_allocations(), __nr_dispatch_allocations);
+		return 1;
+	}
 	else if(strcmp(tokens[0],"cd")==0)
 	{
 		if (nr_tokens==1 || strcmp(tokens[1],"~")==0)	//cd,cd ~
@@ -315,13 +3663,20 @@ static int built_in_command(int nr_tokens, char *tokens[])
 /*          ****** BUT YOU MAY CALL SOME IF YOU WANT TO.. ******      */
 static int __process_command(char * command)
 {
-	char *tokens[MAX_NR_TOKENS] = { NULL };
-	int nr_tokens = 0;
+	static struct tokens tokens;
+	uint64_t start = now_ns();
+	int ret = parse_command(command, &tokens);
 
-	if (parse_command(command, &nr_tokens, tokens) == 0)
-		return 1;
+	trace_span(TRACE_PARSE, start, record_latency(&__stats.parse, start), 0, NULL);
+	if (ret == -EINVAL) fprintf(stderr, "Unterminated quote\n");
+	if (ret <= 0) return 1;
+
+	start = now_ns();
+	ret = run_command(&tokens);
+	trace_span(TRACE_COMMAND, start, record_latency(&__stats.command, start), 0, NULL);
+	__stats.nr_commands++;
 
-	return run_command(nr_tokens, tokens);
+	return ret;
 }
 
 static bool __verbose = true;
@@ -333,6 +3688,8 @@ static void __print_prompt(void)
 	char *prompt = "$";
 	if (!__verbose) return;
 
+	report_jobs();
+
 	fprintf(stderr, "%s%s%s ", __color_start, prompt, __color_end);
 }
 
@@ -341,11 +3698,14 @@ static void __print_prompt(void)
  */
 int main(int argc, char * const argv[])
 {
-	char command[MAX_COMMAND_LEN] = { '\0' };
+	char *command = NULL;
+	size_t size = 0;
+	long arg_max = sysconf(_SC_ARG_MAX);
+	ssize_t len;
 	int ret = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "qm")) != -1) {
+	while ((opt = getopt(argc, argv, "qmel:H:S:T:F:P:")) != -1) {
 		switch (opt) {
 		case 'q':
 			__verbose = false;
@@ -353,6 +3713,37 @@ int main(int argc, char * const argv[])
 		case 'm':
 			__color_start = __color_end = "\0";
 			break;
+		case 'e':
+			__tail_exec = true;
+			break;
+		case 'l':
+			if (strcmp(optarg, "fork") == 0) {
+				__launch_mode = LAUNCH_FORK;
+			} else if (strcmp(optarg, "spawn") == 0) {
+				__launch_mode = LAUNCH_SPAWN;
+			} else {
+				fprintf(stderr, "Unknown launch mode %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			__history_file = optarg;
+			break;
+		case 'S':
+			__shared_history_file = optarg;
+			break;
+		case 'T':
+			__trace_file = optarg;
+			break;
+		case 'F':
+			__flight_file = optarg;
+			break;
+		case 'P':
+			if (set_pipe_size(optarg)) {
+				fprintf(stderr, "Invalid pipe size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		}
 	}
 
@@ -363,19 +3754,29 @@ int main(int argc, char * const argv[])
 	 * abnormal exit after fork()
 	 */
 	setvbuf(stdin, NULL, _IONBF, 0);
+	init_input();
 
 	while (true) {
+		reap_jobs();
 		__print_prompt();
 
-		if (!fgets(command, sizeof(command), stdin)) break;
+		if ((len = read_command(&command, &size)) < 0) break;
+
+		/* The arguments could not be passed to exec() anyway */
+		if (arg_max > 0 && len > arg_max) {
+			fprintf(stderr, "Command too long\n");
+			continue;
+		}
 
 		append_history(command);
+		__last_command = __tail_exec && end_of_input();
 		ret = __process_command(command);
 
 		if (!ret) break;
 	}
 
 	finalize(argc, argv);
+	free(command);
 
 	return EXIT_SUCCESS;
 }
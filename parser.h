@@ -16,20 +16,42 @@
 #ifndef __PARSER_H__
 #define __PARSER_H__
 
-#define MAX_NR_TOKENS	32	/* Maximum length of tokens in a command */
-#define MAX_TOKEN_LEN	128	/* Maximum length of single token */
-#define MAX_COMMAND_LEN	4096 /* Maximum length of assembly string */
+#include "types.h"
+
+/***********************************************************************
+ * struct tokens
+ *
+ * DESCRIPTION
+ *  The token vector filled by parse_command(). Tokens point into the parsed
+ *  command, and @tokens[@nr_tokens] is NULL. The vector is grown as needed
+ *  and kept, so pass the same one again to reuse it. Start with all zeroes.
+ */
+struct tokens {
+	int nr_tokens;
+	int size;	/* Number of slots in @tokens */
+	char **tokens;
+	/**
+	 * For each token, 0 if it had no quotes or escapes in it, otherwise
+	 * 1 + the offset in the token of the first byte that was quoted or
+	 * escaped, so that an operator stuck to a quoted word (">'a b'") can
+	 * still be told apart
+	 */
+	unsigned int *quoted;
+};
 
 
 /***********************************************************************
  * parse_command()
  *
  * DESCRIPTION
- *  Parse @command, and put each command token into @tokens[] and the number of
- *  tokes into @nr_tokens. You may use this implemention or your own from PA0.
+ *  Parse @command in place, and put each command token into @tokens->tokens[]
+ *  and the number of tokens into @tokens->nr_tokens. No memory is allocated
+ *  per token; the vector only grows when a line has more tokens than before.
  *
  *  A command token is defined as a string without any whitespace (i.e., *space*
- *  and *tab* in this programming assignment). For exmaple,
+ *  and *tab* in this programming assignment). Whitespace can be put into a
+ *  token by quoting it with '...' or "..." or escaping it with '\', and the
+ *  quotes and backslashes are removed in place. For exmaple,
  *   command = "  cp  -pr /home/sslab   /path/to/dest  "
  *
  *  then, nr_tokens = 4, and tokens is
@@ -37,14 +59,18 @@
  *    tokens[1] = "-pr"
  *    tokens[2] = "/home/sslab"
  *    tokens[3] = "/path/to/dest"
- *    tokens[>=4] = NULL
+ *    tokens[4] = NULL
  *
  *
  * RETURN VALUE
  *  Return 1 if @nr_tokens > 0
- *  Return 0 otherwise
+ *  Return 0 if @command is empty
+ *  Return -EINVAL if a quote is not closed
+ *  Return -ENOMEM if the vector cannot grow
  *
  */
-int parse_command(char *command, int *nr_tokens, char *tokens[]);
+int parse_command(char *command, struct tokens *tokens);
+
+bool is_operator(struct tokens *tokens, int i, const char *op);
 
 #endif